@@ -0,0 +1,324 @@
+// Micro-benchmarks of the core rendering paths.
+//
+// clang-format off
+// Usage: bench.out [--filter=TEXT] [--format=csv|json] [--repeats=N] [--min-time=MS]
+// clang-format on
+//
+// Every case is timed in batches of iterations long enough to last about
+// --min-time milliseconds (default 20), --repeats times (default 5), and
+// reported with the median and minimum time per iteration. Inputs come
+// from fixed seeds and plots have fixed sizes, independent of the terminal,
+// so runs on the same machine compare. Results go to stdout as CSV or as
+// one JSON object per line; --filter keeps the cases whose name contains
+// the given text.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <askiplot.hpp>
+
+using namespace std;
+using namespace askiplot;
+
+namespace {
+
+struct Options {
+  string filter;
+  bool json = false;
+  int repeats = 5;
+  double min_time_ms = 20;
+};
+
+struct Size {
+  int width;
+  int height;
+};
+
+const Size kCanvasSizes[] = {{80, 24}, {200, 60}, {1000, 300}};
+const size_t kInputScales[] = {1000, 100000};
+
+// Keeps the compiler from discarding a value computed only to be timed
+template<class T>
+void KeepAlive(const T& value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+string SizeName(const Size& size) {
+  return to_string(size.width) + "x" + to_string(size.height);
+}
+
+class Runner {
+public:
+  explicit Runner(const Options& options) : options_(options) {
+    cout << fixed << setprecision(1);
+    if (options_.json) {
+      return;
+    }
+    cout << "name,size,scale,iterations,median_ns,min_ns\n";
+  }
+
+  // Times fn, which performs one iteration of the case per call
+  void Run(const string& name, const string& size, size_t scale,
+           const function<void()>& fn) {
+    Run(name, size, scale, nullptr, fn);
+  }
+
+  // As above, calling setup before every iteration, outside of the timing
+  void Run(const string& name, const string& size, size_t scale,
+           const function<void()>& setup, const function<void()>& fn) {
+    const string full_name = name + "/" + size + "/" + to_string(scale);
+    if (full_name.find(options_.filter) == string::npos) {
+      return;
+    }
+
+    using Clock = chrono::steady_clock;
+    auto time_batch = [&setup, &fn](size_t iterations) {
+      if (!setup) {
+        const auto begin = Clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+          fn();
+        }
+        return chrono::duration<double, nano>(Clock::now() - begin).count();
+      }
+      double elapsed = 0;
+      for (size_t i = 0; i < iterations; ++i) {
+        setup();
+        const auto begin = Clock::now();
+        fn();
+        elapsed += chrono::duration<double, nano>(Clock::now() - begin).count();
+      }
+      return elapsed;
+    };
+
+    // Warm up caches, then grow the batch up to the minimum time
+    size_t iterations = 1;
+    double elapsed = time_batch(iterations);
+    while (elapsed < options_.min_time_ms * 1e6 && iterations < (1u << 30)) {
+      iterations *= 2;
+      elapsed = time_batch(iterations);
+    }
+
+    vector<double> per_iteration;
+    for (int r = 0; r < options_.repeats; ++r) {
+      per_iteration.push_back(time_batch(iterations) / iterations);
+    }
+    sort(per_iteration.begin(), per_iteration.end());
+    const double median = per_iteration[per_iteration.size() / 2];
+    const double min = per_iteration.front();
+
+    if (options_.json) {
+      cout << "{\"name\":\"" << name << "\",\"size\":\"" << size
+           << "\",\"scale\":" << scale << ",\"iterations\":" << iterations
+           << ",\"median_ns\":" << median << ",\"min_ns\":" << min << "}\n";
+    } else {
+      cout << name << "," << size << "," << scale << "," << iterations << ","
+           << median << "," << min << "\n";
+    }
+    cout.flush();
+  }
+
+private:
+  Options options_;
+};
+
+vector<double> UniformData(size_t n, uint64_t seed) {
+  Xoshiro256 rng(seed);
+  vector<double> data(n);
+  for (auto& value : data) {
+    value = (rng() >> 11) * 0x1.0p-53;
+  }
+  return data;
+}
+
+// Sum of uniforms, roughly bell shaped
+vector<double> BellData(size_t n, uint64_t seed) {
+  Xoshiro256 rng(seed);
+  vector<double> data(n);
+  for (auto& value : data) {
+    value = 0;
+    for (int k = 0; k < 4; ++k) {
+      value += (rng() >> 11) * 0x1.0p-53;
+    }
+  }
+  return data;
+}
+
+vector<double> Sequence(size_t n) {
+  vector<double> data(n);
+  for (size_t i = 0; i < n; ++i) {
+    data[i] = i;
+  }
+  return data;
+}
+
+// A plot with some of every kind of content, so that nothing is trivially
+// blank
+Plot BusyPlot(const Size& size) {
+  Plot plot(size.width, size.height);
+  const auto x = UniformData(size.width * 4, 1);
+  const auto y = UniformData(size.width * 4, 2);
+  plot.DrawPoints(x, y)
+      .DrawLine(0.1, 0.1, 0.9, 0.8)
+      .DrawBorders()
+      .DrawText("askiplot", Center);
+  return plot;
+}
+
+Image NoiseImage(int width, int height) {
+  Xoshiro256 rng(3);
+  vector<uint8_t> levels(static_cast<size_t>(width) * height);
+  for (int j = 0; j < height; ++j) {
+    for (int i = 0; i < width; ++i) {
+      // Gradient with noise, as photos have both
+      levels[static_cast<size_t>(j) * width + i] =
+          (i * 255 / width + rng.Below(64)) / 2 + j * 64 / height;
+    }
+  }
+  return Image(width, height, levels);
+}
+
+void BenchCanvas(Runner& runner, const Size& size) {
+  const string name = SizeName(size);
+
+  Plot busy = BusyPlot(size);
+  runner.Run("serialize", name, 1, [&] {
+    const string out = busy.Serialize();
+    KeepAlive(out);
+  });
+
+  Plot fill(size.width, size.height);
+  runner.Run("fill", name, 1, [&] { KeepAlive(fill.Fill()); });
+
+  Plot base(size.width, size.height);
+  const Plot overlay = BusyPlot({size.width / 2, size.height / 2});
+  runner.Run("fuse_keep_blanks", name, 1, [&] {
+    KeepAlive(base.Fuse(overlay, Center, KeepBlanks));
+  });
+  runner.Run("fuse_ignore_blanks", name, 1, [&] {
+    KeepAlive(base.Fuse(overlay, Center, IgnoreBlanks));
+  });
+
+  Xoshiro256 rng(4);
+  Plot lines(size.width, size.height);
+  runner.Run("draw_line", name, 1, [&] {
+    const double x0 = (rng() >> 11) * 0x1.0p-53, y0 = (rng() >> 11) * 0x1.0p-53;
+    const double x1 = (rng() >> 11) * 0x1.0p-53, y1 = (rng() >> 11) * 0x1.0p-53;
+    KeepAlive(lines.DrawLine(x0, y0, x1, y1));
+  });
+
+  GridPlot grid(2, 2, size.width, size.height);
+  Plot cell = BusyPlot({size.width / 2, size.height / 2});
+  grid.SetInRowMajor()(cell)(cell)(cell)(cell).Set();
+  runner.Run("grid_serialize", name, 1, [&] {
+    const string out = grid.Serialize();
+    KeepAlive(out);
+  });
+
+  // Copies start with an empty resize cache, so each iteration resamples
+  const Image photo = NoiseImage(640, 480);
+  Image copy = photo;
+  auto fresh_copy = [&] { copy = photo; };
+  runner.Run("image_resize", name, 640 * 480, fresh_copy, [&] {
+    KeepAlive(copy.Resize(size.width, size.height));
+  });
+
+  Plot image_plot(size.width, size.height);
+  runner.Run("draw_image", name, 640 * 480, fresh_copy, [&] {
+    KeepAlive(image_plot.DrawImage(copy, FixedGamma{}));
+  });
+  runner.Run("draw_image_cached", name, 640 * 480, [&] {
+    KeepAlive(image_plot.DrawImage(photo, FixedGamma{}));
+  });
+}
+
+void BenchData(Runner& runner, const Size& size, size_t scale) {
+  const string name = SizeName(size);
+  const auto x = UniformData(scale, 5);
+  const auto y = UniformData(scale, 6);
+
+  Plot points(size.width, size.height);
+  runner.Run("draw_points", name, scale, [&] {
+    KeepAlive(points.DrawPoints(x, y));
+  });
+
+  const auto bell = BellData(scale, 7);
+  runner.Run("plot_histogram", name, scale, [&] {
+    HistPlot hist(size.width, size.height);
+    KeepAlive(hist.PlotHistogram(bell, "bell"));
+  });
+
+  const auto index = Sequence(scale);
+  BarPlot bars(size.width, size.height);
+  runner.Run("plot_bars", name, scale, [&] {
+    KeepAlive(bars.PlotBars(index, y));
+  });
+}
+
+void BenchGroups(Runner& runner, const Size& size) {
+  const string name = SizeName(size);
+  // As many groups of three bars as fit
+  const size_t groups = max(1, size.width / 4);
+  const vector<double> a = UniformData(groups, 8);
+  const vector<double> b = UniformData(groups, 9);
+  const vector<double> c = UniformData(groups, 10);
+  runner.Run("bar_grouper_commit", name, groups, [&] {
+    BarPlot plot(size.width, size.height);
+    BarGrouper grouper(plot);
+    grouper.Add(a, Scaled, "a").Add(b, Scaled, "b").Add(c, NotScaled, "c");
+    KeepAlive(grouper.Commit());
+  });
+}
+
+bool ParseOptions(int argc, char *argv[], Options& options) {
+  for (int i = 1; i < argc; ++i) {
+    const string arg = argv[i];
+    if (arg.compare(0, 9, "--filter=") == 0) {
+      options.filter = arg.substr(9);
+    } else if (arg == "--format=json") {
+      options.json = true;
+    } else if (arg == "--format=csv") {
+      options.json = false;
+    } else if (arg.compare(0, 10, "--repeats=") == 0) {
+      options.repeats = atoi(arg.c_str() + 10);
+      if (options.repeats <= 0) {
+        return false;
+      }
+    } else if (arg.compare(0, 11, "--min-time=") == 0) {
+      options.min_time_ms = atof(arg.c_str() + 11);
+      if (options.min_time_ms <= 0) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // private namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if (!ParseOptions(argc, argv, options)) {
+    cerr << "Usage: " << argv[0]
+         << " [--filter=TEXT] [--format=csv|json] [--repeats=N] [--min-time=MS]"
+         << endl;
+    return 1;
+  }
+
+  Runner runner(options);
+  for (const auto& size : kCanvasSizes) {
+    BenchCanvas(runner, size);
+    for (size_t scale : kInputScales) {
+      BenchData(runner, size, scale);
+    }
+    BenchGroups(runner, size);
+  }
+  return 0;
+}
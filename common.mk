@@ -1,8 +1,21 @@
+CXXFLAGS = -std=c++17 -Wall -Wpedantic -Wextra -O3 -pthread -I ../include
+
+# make ASKIPLOT_LIB=1 links against src/libaskiplot.a, built first with
+# make in src, instead of compiling the plot classes in every program
+ifdef ASKIPLOT_LIB
+CXXFLAGS += -DASKIPLOT_EXTERN_TEMPLATES
+LDLIBS += ../src/libaskiplot.a
+endif
+
 all: $(TARGETS)
 
 %.out: %.cpp
-	$(CXX) -std=c++17 -Wall -Wpedantic -Wextra -O3 -I ../include $< -o $@
+	$(CXX) $(CXXFLAGS) $< $(LDLIBS) -o $@
+
+lib%.a: %.cpp
+	$(CXX) $(CXXFLAGS) -DASKIPLOT_EXTERN_TEMPLATES -c $< -o $*.o
+	$(AR) rcs $@ $*.o
+	rm -f $*.o
 
 clean:
 	rm -f $(TARGETS)
-
@@ -0,0 +1,25 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <askiplot.hpp>
+
+using namespace std;
+using namespace askiplot;
+
+// Plays concatenated binary PGM/PPM images or a YUV4MPEG2 stream, e.g.
+//   ffmpeg -i clip.mp4 -f yuv4mpegpipe -pix_fmt yuv420p - | ./player.out - 24
+int main(int argc, char *argv[]) {
+  const string path = (argc > 1) ? argv[1] : "-";
+  const double fps = (argc > 2) ? atof(argv[2]) : 0.0;
+
+  ImageSequence sequence(path);
+  SequencePlayer player(sequence);
+  Plot p;
+  player.SetFrameRate(fps).Play(p, cout, FixedGamma(" .:-=+*#%@"));
+
+  cerr << player.GetShownFrames() << " frames shown, "
+       << player.GetDroppedFrames() << " dropped" << endl;
+
+  return 0;
+}
@@ -20,7 +20,9 @@ int main() {
   int step = 5;
 
   while (true) {
-    gamma.SetZeroThreshold(zt);
+    // Every frame draws from a fresh stream of the same seed: the animation
+    // is identical from run to run.
+    gamma.SetZeroThreshold(zt).Jump();
     p.DrawImage(turing, gamma);
     cout << p.Serialize();
     this_thread::sleep_for(125ms);
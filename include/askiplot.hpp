@@ -17,25 +17,56 @@
 #define ASKIPLOT_HPP_
 
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <fcntl.h>
-#include <fstream>
 #include <iomanip>
 #include <iterator>
 #include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <numeric>
+#include <ostream>
+#include <poll.h>
 #include <random>
 #include <set>
 #include <sstream>
 #include <string>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
 #include <type_traits>
 #include <unistd.h>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Instrumented plots have another layout, so each configuration gets its own
+// symbols: mixing code built with and without ASKIPLOT_INSTRUMENTATION, e.g.
+// against libaskiplot, then fails to link instead of crashing.
+#if defined(ASKIPLOT_INSTRUMENTATION)
+#define ASKIPLOT_ABI_NAMESPACE instrumented
+#else
+#define ASKIPLOT_ABI_NAMESPACE plain
+#endif
+
 namespace askiplot {
+inline namespace ASKIPLOT_ABI_NAMESPACE {
 
 //********************************* Version *********************************//
 
@@ -51,25 +82,29 @@ class Brush;
 
 template<class T>
 T BlankLike(const T& plot);
-std::vector<Brush> StringToBrushes(const std::string& str);
-std::vector<Brush> StringToBrushes(const char *str);
+inline std::vector<Brush> StringToBrushes(const std::string& str);
+inline std::vector<Brush> StringToBrushes(const char *str);
+inline int DisplayWidth(const std::string& text);
+inline int BigTextWidth(const std::string& text);
 
 
 //************************** Defaults and constants *************************//
 
-std::string DefaultBrushMain = "_";
-std::string DefaultBrushArea = "#";
-std::string DefaultBrushBlank = " ";
-std::string DefaultBrushBorderTop = "_";
-std::string DefaultBrushBorderBottom = "_";
-std::string DefaultBrushBorderLeft = "|";
-std::string DefaultBrushBorderRight = "|";
-std::string DefaultBrushLineHorizontal = "-";
-std::string DefaultBrushLineVertical = "|";
-int BarValuePrecision = 0;
-const std::vector<Brush> kLetterBrushes = StringToBrushes("abcdefghijklmnopqrstuvwxyz");
-const std::vector<Brush> kNumberBrushes = StringToBrushes("0123456789");
-const std::vector<Brush> kSymbolBrushes = StringToBrushes("@$*#.+&*=?,-%!^\"<~>'");
+inline std::string DefaultBrushMain = "_";
+inline std::string DefaultBrushArea = "#";
+inline std::string DefaultBrushBlank = " ";
+inline std::string DefaultBrushBorderTop = "_";
+inline std::string DefaultBrushBorderBottom = "_";
+inline std::string DefaultBrushBorderLeft = "|";
+inline std::string DefaultBrushBorderRight = "|";
+inline std::string DefaultBrushLineHorizontal = "-";
+inline std::string DefaultBrushLineVertical = "|";
+inline int BarValuePrecision = 0;
+// Largest image or frame, in pixels, that decoders accept before allocating
+inline uint64_t MaxImagePixels = uint64_t(1) << 26;
+inline const std::vector<Brush> kLetterBrushes = StringToBrushes("abcdefghijklmnopqrstuvwxyz");
+inline const std::vector<Brush> kNumberBrushes = StringToBrushes("0123456789");
+inline const std::vector<Brush> kSymbolBrushes = StringToBrushes("@$*#.+&*=?,-%!^\"<~>'");
 
 //******************************* Exceptions ********************************//
 
@@ -103,6 +138,20 @@ public:
   }
 };
 
+class InvalidImageFile : public std::exception {
+public:
+  virtual const char* what() const noexcept override {
+    return "Image file is truncated or its header is malformed.";
+  }
+};
+
+class FileNotReadable : public std::exception {
+public:
+  virtual const char* what() const noexcept override {
+    return "Cannot open or read the input file.";
+  }
+};
+
 class InvalidTerminalSize : public std::exception {
 public:
   virtual const char* what() const noexcept override {
@@ -132,9 +181,41 @@ enum Scaling : char {
   Scaled, NotScaled
 };
 
-//******************** Namespace-private free functions *********************//
+enum ColorConversion : char {
+  Average, Luminance
+};
+
+enum Dithering : char {
+  NoDithering, FloydSteinberg, OrderedDithering
+};
+
+enum ColorMode : char {
+  NoColor, Ansi256Color, TrueColor
+};
+
+enum ColorStorage : bool {
+  KeepColor = true, DiscardColor = false
+};
+
+enum LabelOverflow : bool {
+  ShortenLabels = true, DropLabels = false
+};
+
+enum LabelCollisions : bool {
+  AvoidContent = true, AvoidLabelsOnly = false
+};
+
+enum Alignment : char {
+  AlignLeft, AlignCenter, AlignRight
+};
+
+enum LineBreaking : bool {
+  OptimalBreaking = true, GreedyBreaking = false
+};
+
+//************************* Internal free functions *************************//
 
-namespace {
+namespace detail {
 
 template<class Ty, std::enable_if_t<std::is_arithmetic_v<Ty>, bool> = true>
 std::string FormatValue(Ty value) {
@@ -143,7 +224,235 @@ std::string FormatValue(Ty value) {
   return oss.str();
 }
 
-} // private namespace
+// Splits [begin, end) into contiguous blocks of at least min_block items and
+// runs fn(block_begin, block_end) on each of them in parallel.
+template<class Fn>
+void ParallelFor(int begin, int end, int min_block, Fn fn) {
+  const int n = end - begin;
+  const int hw = std::max(1u, std::thread::hardware_concurrency());
+  const int nthreads = std::min(hw, std::max(1, n / std::max(1, min_block)));
+  if (nthreads <= 1) {
+    if (n > 0) {
+      fn(begin, end);
+    }
+    return;
+  }
+
+  std::vector<std::thread> threads;
+  threads.reserve(nthreads - 1);
+  for (int t = 1; t < nthreads; ++t) {
+    threads.emplace_back(fn,
+                         begin + static_cast<int64_t>(n) * t / nthreads,
+                         begin + static_cast<int64_t>(n) * (t + 1) / nthreads);
+  }
+  fn(begin, begin + n / nthreads);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+} // namespace detail
+
+// Kept reachable as askiplot::FormatValue, which it was before detail
+using detail::FormatValue;
+
+//***************************** Instrumentation *****************************//
+
+// Counters and timers of the work done by plots, compiled in only when
+// ASKIPLOT_INSTRUMENTATION is defined before including this header. Work is
+// added to the stats of the calling thread and, while an instrumented
+// method of a plot runs, to the stats of that plot. Timings include the
+// instrumented calls they make. Allocations are only counted if one
+// translation unit also defines ASKIPLOT_INSTRUMENT_NEW, which replaces the
+// global operator new there.
+
+#if defined(ASKIPLOT_INSTRUMENTATION)
+
+enum InstrumentedApi : char {
+  ApiFill, ApiFuse, ApiDrawPoints, ApiDrawLine, ApiDrawText, ApiDrawImage,
+  ApiDrawLabels, ApiDrawLegend, ApiDrawLegendAuto, ApiPlotData, ApiPlotBars,
+  ApiPlotHistogram, ApiCommit, ApiSerialize, ApiCount
+};
+
+inline const char* GetApiName(InstrumentedApi api) {
+  static const char *const kNames[ApiCount] = {
+    "Fill", "Fuse", "DrawPoints", "DrawLine", "DrawText", "DrawImage",
+    "DrawLabels", "DrawLegend", "DrawLegendAuto", "PlotData", "PlotBars",
+    "PlotHistogram", "Commit", "Serialize"
+  };
+  return kNames[api];
+}
+
+struct ApiTiming {
+  uint64_t calls = 0;
+  uint64_t nanoseconds = 0;
+};
+
+// Writes text as a JSON string, quotes included
+inline void WriteJsonString(std::ostream& out, const std::string& text) {
+  out << '"';
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      const char *const kHex = "0123456789abcdef";
+      out << "\\u00" << kHex[c >> 4] << kHex[c & 0xF];
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+struct RenderStats {
+  uint64_t at_calls = 0;
+  uint64_t cells_written = 0;
+  uint64_t palette_lookups = 0;
+  uint64_t allocations = 0;
+  uint64_t bytes_serialized = 0;
+  ApiTiming apis[ApiCount];
+
+  RenderStats& operator+=(const RenderStats& other) {
+    at_calls += other.at_calls;
+    cells_written += other.cells_written;
+    palette_lookups += other.palette_lookups;
+    allocations += other.allocations;
+    bytes_serialized += other.bytes_serialized;
+    for (int k = 0; k < ApiCount; ++k) {
+      apis[k].calls += other.apis[k].calls;
+      apis[k].nanoseconds += other.apis[k].nanoseconds;
+    }
+    return *this;
+  }
+
+  // Work done between an earlier snapshot and this one
+  RenderStats operator-(const RenderStats& earlier) const {
+    RenderStats delta = *this;
+    delta.at_calls -= earlier.at_calls;
+    delta.cells_written -= earlier.cells_written;
+    delta.palette_lookups -= earlier.palette_lookups;
+    delta.allocations -= earlier.allocations;
+    delta.bytes_serialized -= earlier.bytes_serialized;
+    for (int k = 0; k < ApiCount; ++k) {
+      delta.apis[k].calls -= earlier.apis[k].calls;
+      delta.apis[k].nanoseconds -= earlier.apis[k].nanoseconds;
+    }
+    return delta;
+  }
+
+  // One JSON object, without newline. APIs never called are left out.
+  std::string ToJson(const std::string& label = "") const {
+    std::ostringstream oss;
+    oss << "{\"label\":";
+    WriteJsonString(oss, label);
+    oss << ",\"at_calls\":" << at_calls
+        << ",\"cells_written\":" << cells_written
+        << ",\"palette_lookups\":" << palette_lookups
+        << ",\"allocations\":" << allocations
+        << ",\"bytes_serialized\":" << bytes_serialized
+        << ",\"apis\":{";
+    bool first = true;
+    for (int k = 0; k < ApiCount; ++k) {
+      if (apis[k].calls == 0) continue;
+      oss << (first ? "" : ",") << "\"" << GetApiName(static_cast<InstrumentedApi>(k))
+          << "\":{\"calls\":" << apis[k].calls
+          << ",\"ns\":" << apis[k].nanoseconds << "}";
+      first = false;
+    }
+    oss << "}}";
+    return oss.str();
+  }
+};
+
+struct InstrumentationState {
+  RenderStats thread;
+  RenderStats *plot = nullptr;
+  std::ostream *trace = nullptr;
+  int depth = 0;
+};
+
+inline InstrumentationState& GetInstrumentationState() {
+  thread_local InstrumentationState state;
+  return state;
+}
+
+inline void CountWork(uint64_t RenderStats::*counter, uint64_t n) {
+  auto& state = GetInstrumentationState();
+  state.thread.*counter += n;
+  if (state.plot != nullptr) {
+    state.plot->*counter += n;
+  }
+}
+
+// Times an instrumented method for as long as it is in scope, attributing
+// to its plot the work done meanwhile
+class ApiTimer {
+public:
+  ApiTimer(InstrumentedApi api, RenderStats& plot_stats, const std::string& plot_name)
+      : api_(api)
+      , plot_stats_(plot_stats)
+      , plot_name_(plot_name)
+      , outer_plot_(GetInstrumentationState().plot)
+      , begin_(std::chrono::steady_clock::now()) {
+    auto& state = GetInstrumentationState();
+    state.plot = &plot_stats;
+    ++state.depth;
+  }
+
+  ApiTimer(const ApiTimer&) = delete;
+  ApiTimer& operator=(const ApiTimer&) = delete;
+
+  ~ApiTimer() {
+    const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - begin_).count();
+    auto& state = GetInstrumentationState();
+    --state.depth;
+    state.plot = outer_plot_;
+    for (RenderStats *stats : {&state.thread, &plot_stats_}) {
+      ++stats->apis[api_].calls;
+      stats->apis[api_].nanoseconds += ns;
+    }
+    if (state.trace != nullptr) {
+      *state.trace << "{\"api\":\"" << GetApiName(api_) << "\",\"plot\":";
+      WriteJsonString(*state.trace, plot_name_);
+      *state.trace << ",\"depth\":" << state.depth << ",\"ns\":" << ns << "}\n";
+    }
+  }
+
+private:
+  InstrumentedApi api_;
+  RenderStats& plot_stats_;
+  const std::string& plot_name_;
+  RenderStats *outer_plot_;
+  std::chrono::steady_clock::time_point begin_;
+};
+
+// Work done by the calling thread since it started or last reset
+inline const RenderStats& GetThreadStats() {
+  return GetInstrumentationState().thread;
+}
+
+inline void ResetThreadStats() {
+  GetInstrumentationState().thread = RenderStats{};
+}
+
+// Writes a JSON line for every instrumented call of the calling thread as
+// it returns, with the plot name and the nesting depth. nullptr stops.
+inline void SetTraceStream(std::ostream *out) {
+  GetInstrumentationState().trace = out;
+}
+
+#define ASKIPLOT_COUNT(counter, n) \
+  ::askiplot::CountWork(&::askiplot::RenderStats::counter, (n))
+#define ASKIPLOT_TIME_API(api, plot) \
+  ::askiplot::ApiTimer askiplot_api_timer_((api), (plot).stats_, (plot).name_)
+
+#else
+
+#define ASKIPLOT_COUNT(counter, n) ((void)0)
+#define ASKIPLOT_TIME_API(api, plot) ((void)0)
+
+#endif // ASKIPLOT_INSTRUMENTATION
 
 //**************************** Offset & Position ****************************//
 
@@ -198,70 +507,348 @@ public:
 
 //******************************** Operators ********************************//
 
-Borders operator+(const Borders& a, const Borders& b) {
+inline Borders operator+(const Borders& a, const Borders& b) {
   return static_cast<Borders>(static_cast<char>(a) | static_cast<char>(b));
 }
 
-Borders operator-(const Borders& a, const Borders& b) {
+inline Borders operator-(const Borders& a, const Borders& b) {
   return static_cast<Borders>(static_cast<char>(a) & (~static_cast<char>(b)));
 }
 
-Borders operator&(const Borders& a, const Borders& b) {
+inline Borders operator&(const Borders& a, const Borders& b) {
   return static_cast<Borders>(static_cast<char>(a) & static_cast<char>(b));
 }
 
-Borders operator|(const Borders& a, const Borders& b) {
+inline Borders operator|(const Borders& a, const Borders& b) {
   return a + b;
 }
 
-Offset operator+(const Offset& a, const Offset& b) {
+inline Offset operator+(const Offset& a, const Offset& b) {
   return Offset(a.GetCol() + b.GetCol(), a.GetRow() + b.GetRow());
 }
 
-Offset operator-(const Offset& a) {
+inline Offset operator-(const Offset& a) {
   return Offset(-a.GetCol(), -a.GetRow());
 }
 
-Offset operator-(const Offset& a, const Offset& b) {
+inline Offset operator-(const Offset& a, const Offset& b) {
   return Offset(a.GetCol() - b.GetCol(), a.GetRow() - b.GetRow());
 }
 
-Position operator+(const RelativePosition& relative, const Offset& offset) {
+inline Position operator+(const RelativePosition& relative, const Offset& offset) {
   return Position(offset, relative);
 }
 
-Position operator+(const Offset& offset, const RelativePosition& relative) {
+inline Position operator+(const Offset& offset, const RelativePosition& relative) {
   return Position(offset, relative);
 }
 
-Position operator+(const Position& position, const Offset& offset) {
+inline Position operator+(const Position& position, const Offset& offset) {
   return Position(position.offset + offset, position.relative);
 }
 
-Position operator-(const Position& position, const Offset& offset) {
+inline Position operator-(const Position& position, const Offset& offset) {
   return Position(position.offset - offset, position.relative);
 }
 
-Position operator+(const RelativePosition& relative, const offset_t& offset) {
+inline Position operator+(const RelativePosition& relative, const offset_t& offset) {
   return Position(Offset(offset), relative);
 }
 
-Position operator+(const offset_t& offset, const RelativePosition& relative) {
+inline Position operator+(const offset_t& offset, const RelativePosition& relative) {
   return Position(Offset(offset), relative);
 }
 
-Position operator+(const Position& position, const offset_t& offset) {
+inline Position operator+(const Position& position, const offset_t& offset) {
   return Position(position.offset + Offset(offset), position.relative);
 }
 
-Position operator-(const Position& position, const offset_t& offset) {
+inline Position operator-(const Position& position, const offset_t& offset) {
   return Position(position.offset - Offset(offset), position.relative);
 }
 
-double operator ""_percent(long double p) {
+inline double operator ""_percent(long double p) {
   return p / 100.0;
 }
 
+//********************************** Color **********************************//
+
+class Color {
+public:
+  Color()
+      : rgb_(kNoColor) { }
+
+  Color(uint8_t red, uint8_t green, uint8_t blue)
+      : rgb_((red << 16) | (green << 8) | blue) { }
+
+  bool IsSet() const { return rgb_ != kNoColor; }
+
+  bool operator==(const Color& other) const { return rgb_ == other.rgb_; }
+  bool operator!=(const Color& other) const { return rgb_ != other.rgb_; }
+
+  // Whether both colors are rendered with the same escape sequence
+  bool LooksLike(const Color& other, ColorMode mode) const {
+    if (mode == Ansi256Color && IsSet() && other.IsSet()) {
+      return ToAnsi256() == other.ToAnsi256();
+    }
+    return rgb_ == other.rgb_;
+  }
+
+  // Appends the escape sequence selecting this color as foreground, or the
+  // default foreground if the color is not set.
+  void AppendEscape(std::string& out, ColorMode mode) const {
+    char buffer[24];
+    if (!IsSet()) {
+      out += "\x1b[39m";
+    } else if (mode == TrueColor) {
+      out.append(buffer, std::snprintf(buffer, sizeof(buffer), "\x1b[38;2;%d;%d;%dm",
+                                       GetRed(), GetGreen(), GetBlue()));
+    } else {
+      out.append(buffer, std::snprintf(buffer, sizeof(buffer), "\x1b[38;5;%dm", ToAnsi256()));
+    }
+  }
+
+  // Nearest entry of the xterm 256-color palette, excluding the 16 system
+  // colors whose actual values depend on the terminal theme.
+  uint8_t ToAnsi256() const {
+    const auto& lut = Ansi256Table();
+    return lut[(GetRed() >> 3) << 10 | (GetGreen() >> 3) << 5 | (GetBlue() >> 3)];
+  }
+
+  // Getters
+
+  uint8_t GetRed() const { return rgb_ >> 16; }
+  uint8_t GetGreen() const { return rgb_ >> 8; }
+  uint8_t GetBlue() const { return rgb_; }
+
+private:
+  static constexpr uint32_t kNoColor = 0xFF000000;
+
+  // Palette index of every color quantized to 5 bits per channel, built on
+  // first use: the nearest of the 6x6x6 cube and of the grey ramp.
+  static const std::vector<uint8_t>& Ansi256Table() {
+    static const std::vector<uint8_t> table = [] {
+      static constexpr int kCube[6] = {0, 95, 135, 175, 215, 255};
+      auto nearest_cube = [](int c) {
+        int best = 0;
+        for (int k = 1; k < 6; ++k) {
+          if (std::abs(kCube[k] - c) < std::abs(kCube[best] - c)) {
+            best = k;
+          }
+        }
+        return best;
+      };
+      auto square = [](int x) { return x * x; };
+
+      std::vector<uint8_t> lut(32 * 32 * 32);
+      for (int r = 0; r < 32; ++r) {
+        for (int g = 0; g < 32; ++g) {
+          for (int b = 0; b < 32; ++b) {
+            const int red = r * 255 / 31, green = g * 255 / 31, blue = b * 255 / 31;
+            const int cr = nearest_cube(red), cg = nearest_cube(green), cb = nearest_cube(blue);
+            const int cube_dist = square(kCube[cr] - red) + square(kCube[cg] - green) +
+                                  square(kCube[cb] - blue);
+            const int grey_step = std::max(0, std::min(23, ((red + green + blue) / 3 - 3) / 10));
+            const int grey = 8 + 10 * grey_step;
+            const int grey_dist = square(grey - red) + square(grey - green) + square(grey - blue);
+            lut[r << 10 | g << 5 | b] = (grey_dist < cube_dist) ? 232 + grey_step
+                                                                : 16 + 36 * cr + 6 * cg + cb;
+          }
+        }
+      }
+      return lut;
+    }();
+    return table;
+  }
+
+  uint32_t rgb_;
+};
+
+//********************************* Unicode *********************************//
+
+namespace detail {
+
+// Code point ranges packed as (first << 11) | (last - first), sorted.
+// Generated from the Unicode 14.0 database: zero width are the categories
+// Mn, Me and Cf (but U+00AD) and the Hangul medial jamos; wide are the East
+// Asian Wide and Fullwidth characters.
+inline constexpr uint32_t kZeroWidthRanges[] = {
+  0x0018006f, 0x00241806, 0x002c882c, 0x002df800, 0x002e0801, 0x002e2001, 0x002e3800,
+  0x00300005, 0x0030800a, 0x0030e000, 0x00325814, 0x00338000, 0x0036b007, 0x0036f805,
+  0x00373801, 0x00375003, 0x00387800, 0x00388800, 0x0039801a, 0x003d300a, 0x003f5808,
+  0x003fe800, 0x0040b003, 0x0040d808, 0x00412802, 0x00414804, 0x0042c802, 0x0044800f,
+  0x00465038, 0x0049d000, 0x0049e000, 0x004a0807, 0x004a6800, 0x004a8806, 0x004b1001,
+  0x004c0800, 0x004de000, 0x004e0803, 0x004e6800, 0x004f1001, 0x004ff004, 0x0051e000,
+  0x00520810, 0x00538001, 0x0053a800, 0x00540801, 0x0055e000, 0x00560807, 0x00566800,
+  0x00571001, 0x0057d007, 0x0059e000, 0x0059f800, 0x005a0803, 0x005a6809, 0x005b1001,
+  0x005c1000, 0x005e0000, 0x005e6800, 0x00600000, 0x00602000, 0x0061e000, 0x0061f002,
+  0x00623010, 0x00631001, 0x00640800, 0x0065e000, 0x0065f800, 0x00663000, 0x00666001,
+  0x00671001, 0x00680001, 0x0069d801, 0x006a0803, 0x006a6800, 0x006b1001, 0x006c0800,
+  0x006e5000, 0x006e9004, 0x00718800, 0x0071a006, 0x00723807, 0x00758800, 0x0075a008,
+  0x00764005, 0x0078c001, 0x0079a800, 0x0079b800, 0x0079c800, 0x007b880d, 0x007c0004,
+  0x007c3001, 0x007c682f, 0x007e3000, 0x00816803, 0x00819005, 0x0081c801, 0x0081e801,
+  0x0082c001, 0x0082f002, 0x00838803, 0x00841000, 0x00842801, 0x00846800, 0x0084e800,
+  0x008b009f, 0x009ae802, 0x00b89002, 0x00b99001, 0x00ba9001, 0x00bb9001, 0x00bda001,
+  0x00bdb806, 0x00be3000, 0x00be480a, 0x00bee800, 0x00c05804, 0x00c42801, 0x00c54800,
+  0x00c90002, 0x00c93801, 0x00c99000, 0x00c9c802, 0x00d0b801, 0x00d0d800, 0x00d2b000,
+  0x00d2c008, 0x00d31000, 0x00d32807, 0x00d3980c, 0x00d58053, 0x00d9a000, 0x00d9b004,
+  0x00d9e000, 0x00da1000, 0x00db5808, 0x00dc0001, 0x00dd1003, 0x00dd4001, 0x00dd5802,
+  0x00df3000, 0x00df4001, 0x00df6800, 0x00df7802, 0x00e16007, 0x00e1b001, 0x00e68002,
+  0x00e6a00c, 0x00e71006, 0x00e76800, 0x00e7a000, 0x00e7c001, 0x00ee003f, 0x01005804,
+  0x01015004, 0x0103000f, 0x01068020, 0x01677802, 0x016bf800, 0x016f001f, 0x01815003,
+  0x0184c801, 0x05337803, 0x0533a009, 0x0534f001, 0x05378001, 0x05401000, 0x05403000,
+  0x05405800, 0x05412801, 0x05416000, 0x05462001, 0x05470011, 0x0547f800, 0x05493007,
+  0x054a380a, 0x054c0002, 0x054d9800, 0x054db003, 0x054de001, 0x054f2800, 0x05514805,
+  0x05518801, 0x0551a801, 0x05521800, 0x05526000, 0x0553e000, 0x05558000, 0x05559002,
+  0x0555b801, 0x0555f001, 0x05560800, 0x05576001, 0x0557b000, 0x055f2800, 0x055f4000,
+  0x055f6800, 0x07d8f000, 0x07f0000f, 0x07f1000f, 0x07f7f800, 0x07ffc802, 0x080fe800,
+  0x08170000, 0x081bb004, 0x0850080e, 0x0851c007, 0x08572801, 0x08692003, 0x08755801,
+  0x087a300a, 0x087c1003, 0x08800800, 0x0881c00e, 0x08838000, 0x08839801, 0x0883f802,
+  0x08859803, 0x0885c801, 0x0885e800, 0x0886100b, 0x08880002, 0x08893804, 0x08896807,
+  0x088b9800, 0x088c0001, 0x088db008, 0x088e4803, 0x088e7800, 0x08917802, 0x0891a000,
+  0x0891b001, 0x0891f000, 0x0896f800, 0x08971807, 0x08980001, 0x0899d801, 0x089a0000,
+  0x089b300e, 0x08a1c007, 0x08a21002, 0x08a23000, 0x08a2f000, 0x08a59805, 0x08a5d000,
+  0x08a5f801, 0x08a61001, 0x08ad9003, 0x08ade001, 0x08adf801, 0x08aee001, 0x08b19807,
+  0x08b1e800, 0x08b1f801, 0x08b55800, 0x08b56800, 0x08b58005, 0x08b5b800, 0x08b8e802,
+  0x08b91003, 0x08b93804, 0x08c17808, 0x08c1c801, 0x08c9d801, 0x08c9f000, 0x08ca1800,
+  0x08cea007, 0x08cf0000, 0x08d00809, 0x08d19805, 0x08d1d803, 0x08d23800, 0x08d28805,
+  0x08d2c802, 0x08d4500c, 0x08d4c001, 0x08e1800d, 0x08e1f800, 0x08e49015, 0x08e55006,
+  0x08e59001, 0x08e5a801, 0x08e98814, 0x08ea3800, 0x08ec8001, 0x08eca800, 0x08ecb800,
+  0x08f79801, 0x09a18008, 0x0b578004, 0x0b598006, 0x0b7a7800, 0x0b7c7803, 0x0b7f2000,
+  0x0de4e801, 0x0de507ff, 0x0e2507ff, 0x0e6502a6, 0x0e8b3802, 0x0e8b980f, 0x0e8c2806,
+  0x0e8d5003, 0x0e921002, 0x0ed00036, 0x0ed1d831, 0x0ed3a800, 0x0ed42000, 0x0ed4d814,
+  0x0f00002a, 0x0f098006, 0x0f157000, 0x0f176003, 0x0f468006, 0x0f4a2006, 0x700009ee,
+};
+inline constexpr uint32_t kWideRanges[] = {
+  0x0088005f, 0x0118d001, 0x01194801, 0x011f4803, 0x011f8000, 0x011f9800, 0x012fe801,
+  0x0130a001, 0x0132400b, 0x0133f800, 0x01349800, 0x01350800, 0x01355001, 0x0135e801,
+  0x01362001, 0x01367000, 0x0136a000, 0x01375000, 0x01379001, 0x0137a800, 0x0137d000,
+  0x0137e800, 0x01382800, 0x01385001, 0x01394000, 0x013a6000, 0x013a7000, 0x013a9802,
+  0x013ab800, 0x013ca802, 0x013d8000, 0x013df800, 0x0158d801, 0x015a8000, 0x015aa800,
+  0x017401a9, 0x01817010, 0x01820855, 0x0184d9ac, 0x019287ff, 0x01d287ff, 0x021287ff,
+  0x0252836f, 0x027007ff, 0x02b007ff, 0x02f007ff, 0x033007ff, 0x037007ff, 0x03b007ff,
+  0x03f007ff, 0x043007ff, 0x047007ff, 0x04b007ff, 0x04f006c6, 0x054b001c, 0x056007ff,
+  0x05a007ff, 0x05e007ff, 0x062007ff, 0x066007ff, 0x06a003a3, 0x07c801d9, 0x07f08009,
+  0x07f1803b, 0x07f8085f, 0x07ff0006, 0x0b7f0003, 0x0b7f87ff, 0x0bbf87ff, 0x0bff87ff,
+  0x0c3f87ff, 0x0c7f87ff, 0x0cbf87ff, 0x0cff87ff, 0x0d3f87ff, 0x0d7f830b, 0x0f802000,
+  0x0f867800, 0x0f8c7000, 0x0f8c8809, 0x0f900120, 0x0f996808, 0x0f99b845, 0x0f9bf015,
+  0x0f9d002a, 0x0f9e7804, 0x0f9f0010, 0x0f9fa000, 0x0f9fc046, 0x0fa20000, 0x0fa210ba,
+  0x0fa7f83e, 0x0faa5803, 0x0faa8017, 0x0fabd000, 0x0faca801, 0x0fad2000, 0x0fafd854,
+  0x0fb40045, 0x0fb66000, 0x0fb68002, 0x0fb6a80a, 0x0fb75801, 0x0fb7a008, 0x0fbf0010,
+  0x0fc8602e, 0x0fc9e009, 0x0fca38b8, 0x0fd38086, 0x100007ff, 0x104007ff, 0x108007ff,
+  0x10c007ff, 0x110007ff, 0x114007ff, 0x118007ff, 0x11c007ff, 0x120007ff, 0x124007ff,
+  0x128007ff, 0x12c007ff, 0x130007ff, 0x134007ff, 0x138007ff, 0x13c007ff, 0x140007ff,
+  0x144007ff, 0x148007ff, 0x14c007ff, 0x150007ff, 0x154007ff, 0x158007ff, 0x15c007ff,
+  0x160007ff, 0x164007ff, 0x168007ff, 0x16c007ff, 0x170007ff, 0x174007ff, 0x178007ff,
+  0x17c007ff, 0x180007ff, 0x184007ff, 0x1880034a,
+};
+
+inline bool InRanges(const uint32_t *begin, const uint32_t *end, char32_t cp) {
+  // First range starting after cp, then check the one before it
+  const uint32_t *it = std::upper_bound(begin, end, (static_cast<uint32_t>(cp) << 11) | 0x7FF);
+  return it != begin && cp <= ((it[-1] >> 11) + (it[-1] & 0x7FF));
+}
+
+// Terminal columns taken by a code point: 0, 1 or 2
+inline int CharWidth(char32_t cp) {
+  // Nothing before the combining diacritics is zero width or wide
+  if (cp < 0x300) {
+    return 1;
+  }
+  if (InRanges(std::begin(kZeroWidthRanges), std::end(kZeroWidthRanges), cp)) {
+    return 0;
+  }
+  if (InRanges(std::begin(kWideRanges), std::end(kWideRanges), cp)) {
+    return 2;
+  }
+  return 1;
+}
+
+inline constexpr char kReplacementCharacter[] = "\xEF\xBF\xBD";
+
+// Decodes the UTF-8 sequence at `it` and moves past it. Malformed or
+// truncated sequences consume one byte and decode to U+FFFD.
+inline char32_t DecodeUTF8(const char *&it, const char *end) {
+  const unsigned char lead = *it++;
+  if (lead < 0x80) {
+    return lead;
+  }
+  int length;
+  char32_t cp;
+  if (0xC2 <= lead && lead <= 0xDF) {
+    length = 1;
+    cp = lead & 0x1F;
+  } else if (0xE0 <= lead && lead <= 0xEF) {
+    length = 2;
+    cp = lead & 0x0F;
+  } else if (0xF0 <= lead && lead <= 0xF4) {
+    length = 3;
+    cp = lead & 0x07;
+  } else {
+    return 0xFFFD;
+  }
+  if (end - it < length) {
+    return 0xFFFD;
+  }
+  for (int i = 0; i < length; ++i) {
+    const unsigned char next = it[i];
+    if ((next & 0xC0) != 0x80) {
+      return 0xFFFD;
+    }
+    cp = (cp << 6) | (next & 0x3F);
+  }
+  // Overlong forms, surrogates and code points past U+10FFFF
+  if ((length == 2 && cp < 0x800) || (length == 3 && (cp < 0x10000 || cp > 0x10FFFF)) ||
+      (0xD800 <= cp && cp <= 0xDFFF)) {
+    return 0xFFFD;
+  }
+  it += length;
+  return cp;
+}
+
+// Calls fn(bytes, length, width) for each character of a UTF-8 string.
+// Malformed sequences are passed as U+FFFD.
+template<class Fn>
+void ForEachCharacter(const std::string& text, Fn fn) {
+  const char *it = text.data();
+  const char *end = it + text.size();
+  while (it < end) {
+    const char *begin = it;
+    const char32_t cp = DecodeUTF8(it, end);
+    if (cp == 0xFFFD) {
+      fn(kReplacementCharacter, 3, 1);
+    } else {
+      fn(begin, static_cast<std::size_t>(it - begin), CharWidth(cp));
+    }
+  }
+}
+
+// Longest prefix of a string that fits in the given number of columns
+inline std::string TruncateToWidth(const std::string& text, int columns) {
+  std::string prefix;
+  int width = 0;
+  bool full = false;
+  ForEachCharacter(text, [&](const char *bytes, std::size_t length, int char_width) {
+    full = full || width + char_width > columns;
+    if (!full) {
+      prefix.append(bytes, length);
+      width += char_width;
+    }
+  });
+  return prefix;
+}
+
+// Rows taken by a string written vertically, one character per row
+inline int VerticalLength(const std::string& text) {
+  int length = 0;
+  ForEachCharacter(text, [&length](const char *, std::size_t, int width) {
+    length += (width > 0);
+  });
+  return length;
+}
+
+} // namespace detail
+
 //********************************** Brush **********************************//
 
 class Brush {
@@ -297,22 +884,26 @@ public:
   Brush(const Brush& other) {
     name_ = other.name_;
     value_ = other.value_;
+    color_ = other.color_;
   }
 
   Brush(Brush&& other) {
     name_ = std::move(other.name_);
     value_ = std::move(other.value_);
+    color_ = other.color_;
   }
 
   Brush& operator=(const Brush& other) {
     name_ = other.name_;
     value_ = other.value_;
+    color_ = other.color_;
     return *this;
   }
 
   Brush& operator=(Brush&& other) {
     name_ = std::move(other.name_);
     value_ = std::move(other.value_);
+    color_ = other.color_;
     return *this;
   }
 
@@ -320,17 +911,44 @@ public:
     return name_ == "*";
   }
 
+  bool IsBlank() const {
+    return name_ == "Blank";
+  }
+
   // Getters
 
   std::string GetName() const { return name_; }
   std::string GetValue() const { return value_; }
+  const Color& GetColor() const { return color_; }
 
   // Setters
 
+  Brush& SetColor(const Color& color) {
+    color_ = color;
+    return *this;
+  }
+
   Brush& SetName(const std::string& name) {
     name_ = name.size() == 0 ? "*" : name;
     return *this;
   }
+
+  // Turns this into an uncolored general brush holding one character of
+  // text, given as its UTF-8 bytes. No validation and, for any character,
+  // no allocation. An empty value stands for the cell covered by the right
+  // half of a wide character.
+  Brush& SetText(const char *bytes, std::size_t length) {
+    name_.assign(1, '*');
+    value_.assign(bytes, length);
+    color_ = Color();
+    return *this;
+  }
+
+  // Appends combining characters, drawn over the current one
+  Brush& Append(const char *bytes, std::size_t length) {
+    value_.append(bytes, length);
+    return *this;
+  }
   
   Brush& SetValue(const std::string& value) {
     if (value.empty() || value[0] == '\0') {
@@ -356,6 +974,7 @@ public:
 private:
   std::string name_;
   std::string value_;
+  Color color_;
 };
 
 //********************************* Palette *********************************//
@@ -367,13 +986,18 @@ public:
   }
 
   Palette& operator()(const Brush& brush) {
-    brushes_[brush.GetName()] = brush.GetValue();
+    brushes_[brush.GetName()] = brush;
     return *this;
   }
 
+  // Changes the value of a brush, keeping its color
   template<class T>
   Palette& operator()(const std::string& brush_name, T brush_value) {
     Brush brush(brush_name, brush_value);
+    auto it = brushes_.find(brush_name);
+    if (it != brushes_.end()) {
+      brush.SetColor(it->second.GetColor());
+    }
     this->operator()(brush);
     return *this;
   }
@@ -383,7 +1007,7 @@ public:
     if (it == brushes_.end()) {
       return DefaultBrushBlank;
     }
-    return it->second;
+    return it->second.GetValue();
   }
 
   bool HasBrush(const std::string& name) const {
@@ -392,51 +1016,61 @@ public:
 
   Palette& Reset() {
     brushes_.clear();
-    brushes_.insert({
-      {"Main", DefaultBrushMain},
-      {"Blank", DefaultBrushBlank},
-      {"Area", DefaultBrushArea},
-      {"LineHorizontal", DefaultBrushLineHorizontal},
-      {"LineVertical", DefaultBrushLineVertical},
-      {"BorderTop", DefaultBrushBorderTop},
-      {"BorderBottom", DefaultBrushBorderBottom},
-      {"BorderLeft", DefaultBrushBorderLeft},
-      {"BorderRight", DefaultBrushBorderRight},
-    });
+    for (const auto& brush : {
+      Brush("Main", DefaultBrushMain),
+      Brush("Blank", DefaultBrushBlank),
+      Brush("Area", DefaultBrushArea),
+      Brush("LineHorizontal", DefaultBrushLineHorizontal),
+      Brush("LineVertical", DefaultBrushLineVertical),
+      Brush("BorderTop", DefaultBrushBorderTop),
+      Brush("BorderBottom", DefaultBrushBorderBottom),
+      Brush("BorderLeft", DefaultBrushBorderLeft),
+      Brush("BorderRight", DefaultBrushBorderRight),
+    }) {
+      brushes_.emplace(brush.GetName(), brush);
+    }
     return *this;
   }
 
   // Getters
 
   Brush GetBrush(const std::string& brush_name) const {
+    ASKIPLOT_COUNT(palette_lookups, 1);
     auto it = brushes_.find(brush_name);
     if (it == brushes_.end()) {
       return {};
     }
-    return Brush(brush_name, it->second);
+    return it->second;
   }
 
   // Setters
 
   Palette& SetBrush(const Brush& brush) {
-    brushes_[brush.GetName()] = brush.GetValue();
+    brushes_[brush.GetName()] = brush;
     return *this;
   }
 
   Palette& SetBrush(const std::string name, const std::string& value) {
-    Brush brush(name, value);
-    return SetBrush(brush);
+    return this->operator()(name, value);
   }
 
   Palette& SetBrush(const std::vector<std::string>& names, const std::string& value) {
     for (std::size_t i = 0; i < names.size(); ++i) {
-      SetBrush(Brush(names[i], value));
+      this->operator()(names[i], value);
+    }
+    return *this;
+  }
+
+  Palette& SetColor(const std::string& name, const Color& color) {
+    auto it = brushes_.find(name);
+    if (it != brushes_.end()) {
+      it->second.SetColor(color);
     }
     return *this;
   }
 
 private:
-  std::unordered_map<std::string, std::string> brushes_;
+  std::unordered_map<std::string, Brush> brushes_;
 };
 
 //****************************** PlotMetaData *******************************//
@@ -493,6 +1127,78 @@ public:
 
 class BarPlotMetadata final : public __BarPlotMetadata<BarPlotMetadata> { };
 
+//******************************* Xoshiro256 ********************************//
+
+// xoshiro256** generator (Blackman & Vigna). Each instance carries its own
+// state, and Jump() advances it by 2^128 draws, which splits one seed into
+// non-overlapping streams, e.g. one per block of image rows.
+class Xoshiro256 {
+public:
+  using result_type = uint64_t;
+
+  Xoshiro256(uint64_t seed = 0) {
+    SetSeed(seed);
+  }
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+  result_type operator()() {
+    const uint64_t result = Rotl(s_[1] * 5, 7) * 9;
+    const uint64_t t = s_[1] << 17;
+    s_[2] ^= s_[0];
+    s_[3] ^= s_[1];
+    s_[1] ^= s_[2];
+    s_[0] ^= s_[3];
+    s_[2] ^= t;
+    s_[3] = Rotl(s_[3], 45);
+    return result;
+  }
+
+  // Uniform integer in [0, bound), without the bias of a modulo
+  uint32_t Below(uint32_t bound) {
+    return ((operator()() >> 32) * bound) >> 32;
+  }
+
+  Xoshiro256& Jump() {
+    static constexpr uint64_t kJump[] = {
+      0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c
+    };
+    uint64_t s[4] = {0, 0, 0, 0};
+    for (uint64_t jump : kJump) {
+      for (int b = 0; b < 64; ++b) {
+        if (jump & (uint64_t{1} << b)) {
+          for (int k = 0; k < 4; ++k) {
+            s[k] ^= s_[k];
+          }
+        }
+        operator()();
+      }
+    }
+    std::copy_n(s, 4, s_);
+    return *this;
+  }
+
+  Xoshiro256& SetSeed(uint64_t seed) {
+    // The state is expanded with splitmix64, so that it is never all zeros
+    for (auto& s : s_) {
+      seed += 0x9e3779b97f4a7c15;
+      uint64_t z = seed;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+      s = z ^ (z >> 31);
+    }
+    return *this;
+  }
+
+private:
+  static uint64_t Rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  uint64_t s_[4];
+};
+
 //******************************** Gamma ************************************//
 
 template<class Subtype>
@@ -501,6 +1207,60 @@ public:
   __Gamma() = default;
   virtual ~__Gamma() = default;
   virtual Brush operator()(uint8_t level) = 0;
+
+  // Maps a run of n levels at once, writing for each of them the index of
+  // its brush in GetGlyphs(). By default operator() is called for every
+  // level, and brushes not seen before are added to the glyphs; gammas
+  // giving more than 256 distinct brushes must override it.
+  virtual void MapRow(const uint8_t *levels, std::size_t n, uint8_t *cells) {
+    for (std::size_t i = 0; i < n; ++i) {
+      cells[i] = GetGlyphIndex((*this)(levels[i]));
+    }
+  }
+
+  // First level of every range of levels mapped to the same glyph, except
+  // the range starting at 0. Used to dither images for this gamma. By
+  // default found by calling operator() of a copy on every level.
+  virtual std::vector<uint8_t> GetLevelStarts() const {
+    Subtype probe(static_cast<const Subtype&>(*this));
+    std::vector<uint8_t> starts;
+    Brush previous = probe(0);
+    for (int level = 1; level < 256; ++level) {
+      Brush current = probe(level);
+      if (current.GetValue() != previous.GetValue() ||
+          current.GetColor() != previous.GetColor()) {
+        starts.push_back(level);
+      }
+      previous = std::move(current);
+    }
+    return starts;
+  }
+
+  const std::vector<Brush>& GetGlyphs() const { return glyphs_; }
+
+protected:
+  std::vector<Brush> glyphs_;
+
+private:
+  uint8_t GetGlyphIndex(const Brush& brush) {
+    auto same = [&brush](const Brush& glyph) {
+      return glyph.GetValue() == brush.GetValue() && glyph.GetColor() == brush.GetColor();
+    };
+    if (last_glyph_ < glyphs_.size() && same(glyphs_[last_glyph_])) {
+      return last_glyph_;
+    }
+    auto it = std::find_if(glyphs_.begin(), glyphs_.end(), same);
+    if (it == glyphs_.end()) {
+      if (glyphs_.size() > 255) {
+        throw InconsistentData();
+      }
+      it = glyphs_.insert(it, brush);
+    }
+    last_glyph_ = it - glyphs_.begin();
+    return last_glyph_;
+  }
+
+  uint8_t last_glyph_ = 0;
 };
 
 //****************************** FixedGamma *********************************//
@@ -520,10 +1280,38 @@ public:
     return Brush("*", recodedGamma_[level]);
   }
 
-  Subtype& Shuffle() {
-    std::random_device rd;
-    std::mt19937 g(rd());
-    std::shuffle(gamma_.begin(), gamma_.end(), g);
+  void MapRow(const uint8_t *levels, std::size_t n, uint8_t *cells) override {
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    // The glyph index is the number of level ranges starting at or below
+    // the level, so few-glyph gammas take one compare per glyph.
+    if (starts_.size() < 16) {
+      for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(levels + i));
+        __m128i index = _mm_setzero_si128();
+        for (uint8_t start : starts_) {
+          const __m128i s = _mm_set1_epi8(static_cast<char>(start));
+          index = _mm_sub_epi8(index, _mm_cmpeq_epi8(_mm_max_epu8(v, s), v));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(cells + i), index);
+      }
+    }
+#endif
+    for (; i < n; ++i) {
+      cells[i] = recodedCells_[levels[i]];
+    }
+  }
+
+  std::vector<uint8_t> GetLevelStarts() const override {
+    return starts_;
+  }
+
+  // Fisher-Yates shuffle of the glyphs, reproducible for a given seed
+  Subtype& Shuffle(uint64_t seed = 0) {
+    Xoshiro256 rng(seed);
+    for (std::size_t i = gamma_.size(); i > 1; --i) {
+      std::swap(gamma_[i - 1], gamma_[rng.Below(i)]);
+    }
     return Set(gamma_);
   }
 
@@ -533,16 +1321,27 @@ public:
     std::size_t new_size = std::min<std::size_t>(gamma.size(), 256L);
     gamma_.resize(new_size);
     std::copy_n(gamma.begin(), new_size, gamma_.begin());
+    if (gamma_.empty()) {
+      gamma_ = DefaultBrushBlank;
+    }
 
     recodedGamma_.resize(256);
-    const int levels = gamma.size();
+    const int levels = gamma_.size();
     const int div = 256 / levels;
     int rem = 256 % levels;
 
-    auto rgIt = recodedGamma_.begin();
+    this->glyphs_.clear();
+    starts_.clear();
+    int start = 0;
     for (int i = 0; i < levels; ++i) {
       const int ncopies = div + ((rem > 0) ? 1 : 0);
-      rgIt = std::fill_n(rgIt, ncopies, gamma[i]);
+      std::fill_n(recodedGamma_.begin() + start, ncopies, gamma_[i]);
+      std::fill_n(recodedCells_ + start, ncopies, i);
+      this->glyphs_.push_back(Brush("*", gamma_[i]));
+      if (i > 0) {
+        starts_.push_back(start);
+      }
+      start += ncopies;
       rem--;
     }
 
@@ -552,16 +1351,20 @@ public:
 protected:
   std::string gamma_;
   std::string recodedGamma_;
+  uint8_t recodedCells_[256];
+  std::vector<uint8_t> starts_;
 };
 
 class FixedGamma final : public __FixedGamma<FixedGamma> { using __FixedGamma::__FixedGamma; };
 
 //**************************** VariableGamma ********************************//
 
+// Glyph 0 of variable gammas is always the zero brush.
 template<class Subtype>
 class __VariableGamma : public __Gamma<Subtype> {
 public:
   __VariableGamma() {
+    this->glyphs_.resize(1);
     SetZeroThreshold(128);
     SetZeroBrush(" ");
   }
@@ -571,11 +1374,19 @@ public:
   Brush GetZeroBrush() const { return zero_; }
   uint8_t GetZeroThreshold() const { return threshold_; }
 
+  std::vector<uint8_t> GetLevelStarts() const override {
+    if (threshold_ == 0) {
+      return {};
+    }
+    return {threshold_};
+  }
+
   // Setters
 
   Subtype& SetZeroBrush(Brush brush) {
     brush.SetName("*");
     zero_ = brush;
+    this->glyphs_[0] = brush;
     return static_cast<Subtype&>(*this);
   }
 
@@ -602,20 +1413,50 @@ public:
     if (level < this->threshold_) {
       return this->zero_;
     }
-    return gamma_[rand() % gamma_.size()];
+    return gamma_[rng_.Below(gamma_.size())];
+  }
+
+  void MapRow(const uint8_t *levels, std::size_t n, uint8_t *cells) override {
+    const uint32_t size = gamma_.size();
+    for (std::size_t i = 0; i < n; ++i) {
+      cells[i] = (levels[i] < this->threshold_) ? 0 : 1 + rng_.Below(size);
+    }
+  }
+
+  // Moves to the next of the independent streams of the current seed.
+  // Copies jumped 0, 1, 2... times can map blocks of rows concurrently and
+  // still produce the same picture as any other run with the same seed.
+  Subtype& Jump(int times = 1) {
+    for (int i = 0; i < times; ++i) {
+      rng_.Jump();
+    }
+    return static_cast<Subtype&>(*this);
   }
 
   std::string ToString() const { return gamma_; }
+
+  Subtype& SetSeed(uint64_t seed) {
+    rng_.SetSeed(seed);
+    return static_cast<Subtype&>(*this);
+  }
   
   Subtype& Set(const std::string& gamma) {
-    std::size_t new_size = std::min<std::size_t>(gamma.size(), 256L);
+    std::size_t new_size = std::min<std::size_t>(gamma.size(), 255L);
     gamma_.resize(new_size);
     std::copy_n(gamma.begin(), new_size, gamma_.begin());
+    if (gamma_.empty()) {
+      gamma_ = DefaultBrushBlank;
+    }
+    this->glyphs_.resize(1);
+    for (char c : gamma_) {
+      this->glyphs_.push_back(Brush("*", c));
+    }
     return static_cast<Subtype&>(*this);
   }
   
 protected:
   std::string gamma_;
+  Xoshiro256 rng_;
 };
 
 class RandomGamma final : public __RandomGamma<RandomGamma> { using __RandomGamma::__RandomGamma; };
@@ -626,7 +1467,7 @@ template<class Subtype>
 class __TextGamma : public __VariableGamma<Subtype> {
 public:
   __TextGamma() {
-    text_ = "AskiPlot";
+    SetText("AskiPlot");
   }
 
   __TextGamma(const std::string& text) {
@@ -640,6 +1481,13 @@ public:
     return text_[use_count_++ % text_.size()];
   }
 
+  void MapRow(const uint8_t *levels, std::size_t n, uint8_t *cells) override {
+    const std::size_t size = textCells_.size();
+    for (std::size_t i = 0; i < n; ++i) {
+      cells[i] = (levels[i] < this->threshold_) ? 0 : textCells_[use_count_++ % size];
+    }
+  }
+
   // Getters
   std::string GetText() const { return text_; }
 
@@ -649,162 +1497,1326 @@ public:
     if (text.size() == 0) {
       text_ = " ";
     }
+
+    // One glyph per distinct character of the text. Glyph 0 is the zero
+    // brush, so characters after the 255th distinct one are left out.
+    int glyph_of[256] = {};
+    this->glyphs_.resize(1);
+    textCells_.clear();
+    std::string kept;
+    for (char c : text_) {
+      const uint8_t byte = static_cast<uint8_t>(c);
+      if (glyph_of[byte] == 0) {
+        if (this->glyphs_.size() > 255) {
+          continue;
+        }
+        glyph_of[byte] = this->glyphs_.size();
+        this->glyphs_.push_back(Brush("*", c));
+      }
+      textCells_.push_back(glyph_of[byte]);
+      kept += c;
+    }
+    text_ = kept;
     return static_cast<Subtype&>(*this);
   }
 
 protected:
   std::string text_;
+  std::vector<uint8_t> textCells_;
   int use_count_ = 0;
   bool repeat_;
 };
 
 class TextGamma final : public __TextGamma<TextGamma> { using __TextGamma::__TextGamma; };
 
-//******************************* BMPImage **********************************//
+//**************************** Pixel conversion *****************************//
 
-struct BMPImage {
-  int size;
-  int reserved;
-  int offset;
-  int header_length;
-  int width;
-  int height;
-  int16_t planes;
-  int16_t bits_per_pixel;
-  int compression;
-  int raw_size;
-  int vertical_resolution;
-  int horizontal_resolution;
-  int colors;
-  int important_colors;
-};
+namespace detail {
 
-//********************************* Image ***********************************//
+// BMP stores pixels as BGR(A), Netpbm as RGB
+enum PixelOrder : bool {
+  OrderBGR = false, OrderRGB = true
+};
 
-class Image {
-public:
-  Image(const std::string& path) {
-    std::ifstream input(path, std::ios::binary);
-    input.unsetf(std::ios::skipws);
-    raw_.insert(raw_.begin(), std::istream_iterator<uint8_t>(input), {});
-
-    // Parsing
-    std::string format = "XX";
-    format[0] = raw_[0];
-    format[1] = raw_[1];
-    if (!CheckFormat(format)) {
-      throw BMPFormatNotSupported();
+// Converts a run of pixels to grey levels. Averages are computed as
+// (b + g + r) * 21846 >> 16, which equals floor((b + g + r) / 3) for every
+// possible sum; luminance uses the 8-bit BT.601 weights (29, 150, 77) / 256.
+inline void PixelsToGreyScalar(const uint8_t *src,
+                               uint8_t *dst,
+                               int n,
+                               int bytes_per_pixel,
+                               ColorConversion conversion,
+                               PixelOrder order = OrderBGR) {
+  if (conversion == Luminance) {
+    const unsigned w0 = (order == OrderRGB) ? 77u : 29u;
+    const unsigned w2 = (order == OrderRGB) ? 29u : 77u;
+    for (int i = 0; i < n; ++i, src += bytes_per_pixel) {
+      dst[i] = (w0 * src[0] + 150u * src[1] + w2 * src[2]) >> 8;
     }
-
-    data_ = reinterpret_cast<BMPImage*>(raw_.data() + 2);
-    if (data_->height < 0 || data_->width < 0) {
-      throw BMPFormatNotSupported();
+  } else {
+    for (int i = 0; i < n; ++i, src += bytes_per_pixel) {
+      dst[i] = ((src[0] + src[1] + src[2]) * 21846u) >> 16;
     }
-    width_ = data_->width;
-    height_ = data_->height;
-    img_.resize(width_ * height_);
-
-    ParsePayload();
   }
-  
+}
+
+#if defined(__SSE2__)
+
+// b, g and r hold eight 16-bit channel values each, in memory order
+inline __m128i ChannelsToGrey_SSE2(__m128i b, __m128i g, __m128i r,
+                                   ColorConversion conversion, PixelOrder order) {
+  if (order == OrderRGB) {
+    std::swap(b, r);
+  }
+  __m128i grey;
+  if (conversion == Luminance) {
+    grey = _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(29)),
+                         _mm_mullo_epi16(g, _mm_set1_epi16(150)));
+    grey = _mm_add_epi16(grey, _mm_mullo_epi16(r, _mm_set1_epi16(77)));
+    grey = _mm_srli_epi16(grey, 8);
+  } else {
+    grey = _mm_add_epi16(_mm_add_epi16(b, g), r);
+    grey = _mm_mulhi_epu16(grey, _mm_set1_epi16(21846));
+  }
+  return _mm_packus_epi16(grey, grey);
+}
+
+inline int PixelsToGrey32_SSE2(const uint8_t *src, uint8_t *dst, int n,
+                               ColorConversion conversion, PixelOrder order) {
+  const __m128i mask = _mm_set1_epi32(0xFF);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i));
+    const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * i + 16));
+    const __m128i b = _mm_packs_epi32(_mm_and_si128(lo, mask),
+                                      _mm_and_si128(hi, mask));
+    const __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 8), mask),
+                                      _mm_and_si128(_mm_srli_epi32(hi, 8), mask));
+    const __m128i r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 16), mask),
+                                      _mm_and_si128(_mm_srli_epi32(hi, 16), mask));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i),
+                     ChannelsToGrey_SSE2(b, g, r, conversion, order));
+  }
+  return i;
+}
+
+#if defined(__GNUC__)
+#define ASKIPLOT_HAS_SSSE3_DISPATCH
+
+__attribute__((target("ssse3")))
+inline int PixelsToGrey24_SSSE3(const uint8_t *src, uint8_t *dst, int n,
+                                ColorConversion conversion, PixelOrder order) {
+  // Each 16-byte load holds four whole pixels in its first 12 bytes
+  const __m128i b_lo = _mm_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i g_lo = _mm_setr_epi8(1, -1, 4, -1, 7, -1, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i r_lo = _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i b_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, -1, 3, -1, 6, -1, 9, -1);
+  const __m128i g_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 1, -1, 4, -1, 7, -1, 10, -1);
+  const __m128i r_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 2, -1, 5, -1, 8, -1, 11, -1);
+  int i = 0;
+  // The second load reads 4 bytes past the eighth pixel, hence the margin
+  for (; i + 10 <= n; i += 8) {
+    const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * i));
+    const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * i + 12));
+    const __m128i b = _mm_or_si128(_mm_shuffle_epi8(lo, b_lo), _mm_shuffle_epi8(hi, b_hi));
+    const __m128i g = _mm_or_si128(_mm_shuffle_epi8(lo, g_lo), _mm_shuffle_epi8(hi, g_hi));
+    const __m128i r = _mm_or_si128(_mm_shuffle_epi8(lo, r_lo), _mm_shuffle_epi8(hi, r_hi));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i),
+                     ChannelsToGrey_SSE2(b, g, r, conversion, order));
+  }
+  return i;
+}
+
+inline bool CpuHasSSSE3() {
+  static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+  return has_ssse3;
+}
+#endif // __GNUC__
+
+#endif // __SSE2__
+
+inline void PixelsToGrey(const uint8_t *src,
+                         uint8_t *dst,
+                         int n,
+                         int bytes_per_pixel,
+                         ColorConversion conversion,
+                         PixelOrder order = OrderBGR) {
+  int done = 0;
+#if defined(__SSE2__)
+  if (bytes_per_pixel == 4) {
+    done = PixelsToGrey32_SSE2(src, dst, n, conversion, order);
+  }
+#if defined(ASKIPLOT_HAS_SSSE3_DISPATCH)
+  if (bytes_per_pixel == 3 && CpuHasSSSE3()) {
+    done = PixelsToGrey24_SSSE3(src, dst, n, conversion, order);
+  }
+#endif
+#endif
+  PixelsToGreyScalar(src + done * bytes_per_pixel, dst + done,
+                     n - done, bytes_per_pixel, conversion, order);
+}
+
+// Reorders a run of BGR(A) pixels to packed RGB
+inline void PixelsToRGB(const uint8_t *src, uint8_t *dst, int n, int bytes_per_pixel) {
+  for (int i = 0; i < n; ++i, src += bytes_per_pixel, dst += 3) {
+    dst[0] = src[2];
+    dst[1] = src[1];
+    dst[2] = src[0];
+  }
+}
+
+} // namespace detail
+
+//****************************** MappedFile *********************************//
+
+class MappedFile {
+public:
+  MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw FileNotReadable();
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        mapping_ = addr;
+        data_ = static_cast<const uint8_t*>(addr);
+        size_ = st.st_size;
+      }
+    }
+
+    // Pipes, character devices and unmappable files are read into memory
+    if (mapping_ == nullptr) {
+      std::size_t used = 0;
+      buffer_.resize(1 << 16);
+      while (true) {
+        if (used == buffer_.size()) {
+          buffer_.resize(buffer_.size() * 2);
+        }
+        const ssize_t n = read(fd, buffer_.data() + used, buffer_.size() - used);
+        if (n < 0) {
+          close(fd);
+          throw FileNotReadable();
+        }
+        if (n == 0) {
+          break;
+        }
+        used += n;
+      }
+      buffer_.resize(used);
+      data_ = buffer_.data();
+      size_ = used;
+    }
+    close(fd);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if (mapping_ != nullptr) {
+      munmap(mapping_, size_);
+    }
+  }
+
+  const uint8_t* GetData() const { return data_; }
+  std::size_t GetSize() const { return size_; }
+  bool IsMapped() const { return mapping_ != nullptr; }
+
+private:
+  void *mapping_ = nullptr;
+  const uint8_t *data_ = nullptr;
+  std::size_t size_ = 0;
+  std::vector<uint8_t> buffer_;
+};
+
+//******************************* Dithering *********************************//
+
+namespace detail {
+
+// Splits levels into the ranges a gamma maps to a single glyph (given by
+// the first level of all ranges but the first one) and picks, inside each
+// range, the level that best stands for its glyph when spread evenly
+// between black and white.
+class LevelQuantizer {
+public:
+  LevelQuantizer(const std::vector<uint8_t>& starts) {
+    const int nranges = starts.size() + 1;
+    int range = 0;
+    for (int level = 0; level < 256; ++level) {
+      while (range < nranges - 1 && level >= starts[range]) {
+        ++range;
+      }
+      range_of_[level] = range;
+    }
+    representative_.resize(nranges);
+    for (int k = 0; k < nranges; ++k) {
+      const int lo = (k == 0) ? 0 : starts[k - 1];
+      const int hi = (k == nranges - 1) ? 255 : starts[k] - 1;
+      const int ideal = (nranges == 1) ? 0 : k * 255 / (nranges - 1);
+      representative_[k] = std::max(lo, std::min(hi, ideal));
+    }
+  }
+
+  int GetRanges() const { return representative_.size(); }
+
+  // Distance between two consecutive representatives
+  int GetSpacing() const { return 255 / std::max(1, GetRanges() - 1); }
+
+  uint8_t Quantize(uint8_t level) const { return representative_[range_of_[level]]; }
+
+private:
+  uint8_t range_of_[256];
+  std::vector<uint8_t> representative_;
+};
+
+// Adds an 8x8 Bayer threshold offset of +/- half a quantization step to
+// every level, with saturation. Rows are independent of each other.
+inline void DitherOrdered(uint8_t *levels, int width, int height, const LevelQuantizer& quantizer) {
+  static constexpr uint8_t kBayer[8][8] = {
+    { 0, 32,  8, 40,  2, 34, 10, 42},
+    {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44,  4, 36, 14, 46,  6, 38},
+    {60, 28, 52, 20, 62, 30, 54, 22},
+    { 3, 35, 11, 43,  1, 33,  9, 41},
+    {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47,  7, 39, 13, 45,  5, 37},
+    {63, 31, 55, 23, 61, 29, 53, 21},
+  };
+  const int spacing = quantizer.GetSpacing();
+
+  // Offsets of each matrix row, split into an added and a subtracted part
+  // so that saturating byte arithmetic applies them.
+  std::vector<uint8_t> up(8 * (width + 16)), down(8 * (width + 16));
+  for (int r = 0; r < 8; ++r) {
+    for (int x = 0; x < width + 16; ++x) {
+      const int offset = (2 * kBayer[r][x % 8] + 1 - 64) * spacing / 128;
+      up[r * (width + 16) + x] = std::max(0, offset);
+      down[r * (width + 16) + x] = std::max(0, -offset);
+    }
+  }
+
+  ParallelFor(0, height, std::max(1, (1 << 16) / width), [&](int row_beg, int row_end) {
+    for (int y = row_beg; y < row_end; ++y) {
+      uint8_t *row = levels + static_cast<std::size_t>(y) * width;
+      const uint8_t *row_up = &up[(y % 8) * (width + 16)];
+      const uint8_t *row_down = &down[(y % 8) * (width + 16)];
+      int x = 0;
+#if defined(__SSE2__)
+      for (; x + 16 <= width; x += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+        v = _mm_adds_epu8(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(row_up + x)));
+        v = _mm_subs_epu8(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(row_down + x)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + x), v);
+      }
+#endif
+      for (; x < width; ++x) {
+        row[x] = std::max(0, std::min(255, row[x] + row_up[x] - row_down[x]));
+      }
+    }
+  });
+}
+
+// Floyd-Steinberg error diffusion in a single top-down pass, keeping the
+// errors of the current and the next row only (scaled by 16).
+inline void DitherFloydSteinberg(uint8_t *levels, int width, int height, const LevelQuantizer& quantizer) {
+  std::vector<int> current(width + 2), next(width + 2);
+  for (int y = height - 1; y >= 0; --y) {
+    uint8_t *row = levels + static_cast<std::size_t>(y) * width;
+    std::fill(next.begin(), next.end(), 0);
+    for (int x = 0; x < width; ++x) {
+      const int carried = current[x + 1];
+      const int wanted = row[x] + (carried >= 0 ? carried + 8 : carried - 8) / 16;
+      const uint8_t clamped = std::max(0, std::min(255, wanted));
+      const uint8_t chosen = quantizer.Quantize(clamped);
+      const int error = clamped - chosen;
+      row[x] = chosen;
+      current[x + 2] += 7 * error;
+      next[x] += 3 * error;
+      next[x + 1] += 5 * error;
+      next[x + 2] += error;
+    }
+    std::swap(current, next);
+  }
+}
+
+} // namespace detail
+
+//****************************** ResizePlan *********************************//
+
+// Source box covered by every destination column and row. Boxes partition
+// the source when shrinking and are one pixel wide when enlarging, so a
+// plan can be computed once and applied to any image of the same size.
+class ResizePlan {
+public:
+  ResizePlan(int src_width, int src_height, int dst_width, int dst_height) {
+    if (src_width <= 0 || src_height <= 0 || dst_width <= 0 || dst_height <= 0) {
+      throw InvalidPlotSize();
+    }
+    src_width_ = src_width;
+    src_height_ = src_height;
+    Partition(src_width, dst_width, cols_begin_, cols_end_);
+    Partition(src_height, dst_height, rows_begin_, rows_end_);
+  }
+
+  bool Matches(int src_width, int src_height, int dst_width, int dst_height) const {
+    return src_width_ == src_width && src_height_ == src_height &&
+           GetWidth() == dst_width && GetHeight() == dst_height;
+  }
+
+  // Getters
+
+  int GetSourceWidth() const { return src_width_; }
+  int GetSourceHeight() const { return src_height_; }
+  int GetWidth() const { return cols_begin_.size(); }
+  int GetHeight() const { return rows_begin_.size(); }
+  int GetColumnBegin(int col) const { return cols_begin_[col]; }
+  int GetColumnEnd(int col) const { return cols_end_[col]; }
+  int GetRowBegin(int row) const { return rows_begin_[row]; }
+  int GetRowEnd(int row) const { return rows_end_[row]; }
+
+private:
+  static void Partition(int src_len, int dst_len,
+                        std::vector<int>& begin, std::vector<int>& end) {
+    begin.resize(dst_len);
+    end.resize(dst_len);
+    for (int i = 0; i < dst_len; ++i) {
+      begin[i] = static_cast<int64_t>(i) * src_len / dst_len;
+      end[i] = std::max<int>(begin[i] + 1, static_cast<int64_t>(i + 1) * src_len / dst_len);
+    }
+  }
+
+  int src_width_;
+  int src_height_;
+  std::vector<int> cols_begin_, cols_end_;
+  std::vector<int> rows_begin_, rows_end_;
+};
+
+//******************************* BMPImage **********************************//
+
+// Everything in a BMP file after the two-byte signature, up to the end of
+// the BITMAPINFOHEADER. Only ever filled with memcpy, never aliased.
+struct BMPImage {
+  int size;
+  int reserved;
+  int offset;
+  int header_length;
+  int width;
+  int height;
+  int16_t planes;
+  int16_t bits_per_pixel;
+  int compression;
+  int raw_size;
+  int vertical_resolution;
+  int horizontal_resolution;
+  int colors;
+  int important_colors;
+};
+
+//******************************** Netpbm ***********************************//
+
+namespace detail {
+
+// Header of a PBM/PGM/PPM file (P1 to P6). The payload starts right after
+// the single whitespace byte that terminates the header.
+struct NetpbmHeader {
+  int format = 0;
+  int width = 0;
+  int height = 0;
+  int maxval = 1;
+  std::size_t payload_offset = 0;
+
+  bool IsBinary() const { return format >= 4; }
+  int GetChannels() const { return (format == 3 || format == 6) ? 3 : 1; }
+  int GetBytesPerSample() const { return maxval > 255 ? 2 : 1; }
+
+  // Row size in bytes of a binary payload
+  std::size_t GetStride() const {
+    if (format == 4) {
+      return (static_cast<std::size_t>(width) + 7) / 8;
+    }
+    return static_cast<std::size_t>(width) * GetChannels() * GetBytesPerSample();
+  }
+};
+
+inline bool IsNetpbmSpace(uint8_t c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Skips whitespace and '#' comments. Returns false if the data ends first.
+inline bool SkipNetpbmSpaces(const uint8_t *data, std::size_t size, std::size_t& pos) {
+  while (pos < size) {
+    if (data[pos] == '#') {
+      while (pos < size && data[pos] != '\n') {
+        ++pos;
+      }
+    } else if (IsNetpbmSpace(data[pos])) {
+      ++pos;
+    } else {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads an unsigned decimal. Returns false if the data ends before the
+// number is terminated; throws if the next token is not a number.
+inline bool ReadNetpbmNumber(const uint8_t *data, std::size_t size, std::size_t& pos, int& value) {
+  if (!SkipNetpbmSpaces(data, size, pos)) {
+    return false;
+  }
+  if (data[pos] < '0' || data[pos] > '9') {
+    throw InvalidImageFile();
+  }
+  uint64_t number = 0;
+  while (pos < size && data[pos] >= '0' && data[pos] <= '9') {
+    number = number * 10 + (data[pos++] - '0');
+    if (number > static_cast<uint64_t>(std::numeric_limits<int>::max())) {
+      throw InvalidImageFile();
+    }
+  }
+  value = static_cast<int>(number);
+  return pos < size;
+}
+
+inline bool IsNetpbm(const uint8_t *data, std::size_t size) {
+  return size >= 2 && data[0] == 'P' && data[1] >= '1' && data[1] <= '6';
+}
+
+// Returns false if the header is not complete yet, so that callers reading
+// from a stream can retry with more data. Throws on malformed headers.
+inline bool ParseNetpbmHeader(const uint8_t *data, std::size_t size, NetpbmHeader& header) {
+  if (size < 2) {
+    return false;
+  }
+  if (!IsNetpbm(data, size)) {
+    throw InvalidImageFile();
+  }
+  header.format = data[1] - '0';
+  std::size_t pos = 2;
+  if (!ReadNetpbmNumber(data, size, pos, header.width) ||
+      !ReadNetpbmNumber(data, size, pos, header.height)) {
+    return false;
+  }
+  header.maxval = 1;
+  if (header.format != 1 && header.format != 4 &&
+      !ReadNetpbmNumber(data, size, pos, header.maxval)) {
+    return false;
+  }
+  if (header.width <= 0 || header.height <= 0 ||
+      header.maxval <= 0 || header.maxval > 65535) {
+    throw InvalidImageFile();
+  }
+  if (!IsNetpbmSpace(data[pos])) {
+    throw InvalidImageFile();
+  }
+  header.payload_offset = pos + 1;
+  return true;
+}
+
+} // namespace detail
+
+//********************************** GIF ************************************//
+
+namespace detail {
+
+// Decodes the frames of a GIF87a/GIF89a file one at a time, compositing
+// each onto an RGB canvas (top row first) according to its disposal method.
+class GifDecoder {
+public:
+  GifDecoder(const uint8_t *data, std::size_t size)
+      : data_(data)
+      , size_(size) {
+    if (!IsGif(data, size) || size < 13) {
+      throw InvalidImageFile();
+    }
+    width_ = ReadWord(6);
+    height_ = ReadWord(8);
+    if (width_ == 0 || height_ == 0 ||
+        static_cast<uint64_t>(width_) * height_ > MaxImagePixels) {
+      throw InvalidImageFile();
+    }
+    const uint8_t packed = data_[10];
+    const uint8_t background = data_[11];
+    pos_ = 13;
+    if (packed & 0x80) {
+      global_table_ = ReadColorTable(packed & 0x07);
+    }
+
+    // Disposal to background clears to the background color, or black
+    uint8_t background_rgb[3] = {0, 0, 0};
+    if (3u * background + 2 < global_table_.size()) {
+      std::memcpy(background_rgb, &global_table_[3 * background], 3);
+    }
+    canvas_.resize(static_cast<std::size_t>(width_) * height_ * 3);
+    for (std::size_t i = 0; i < canvas_.size(); i += 3) {
+      std::memcpy(&canvas_[i], background_rgb, 3);
+    }
+    background_ = canvas_;
+  }
+
+  static bool IsGif(const uint8_t *data, std::size_t size) {
+    return size >= 6 && (std::memcmp(data, "GIF87a", 6) == 0 ||
+                         std::memcmp(data, "GIF89a", 6) == 0);
+  }
+
+  int GetWidth() const { return width_; }
+  int GetHeight() const { return height_; }
+  const std::vector<uint8_t>& GetCanvas() const { return canvas_; }
+
+  // Display time of the last decoded frame, in milliseconds
+  int GetDelay() const { return delay_; }
+
+  // Number of repetitions from the NETSCAPE2.0 extension, 0 meaning forever
+  int GetLoopCount() const { return loops_; }
+
+  // Composites the next frame onto the canvas. Returns false at the end.
+  bool NextFrame() {
+    // Undo the previous frame if it asked for it
+    if (disposal_ == 2) {
+      for (int y = 0; y < frame_h_; ++y) {
+        const std::size_t row = 3 * ((static_cast<std::size_t>(frame_y_ + y)) * width_ + frame_x_);
+        std::memcpy(&canvas_[row], &background_[row], 3 * frame_w_);
+      }
+    } else if (disposal_ == 3) {
+      canvas_ = previous_;
+    }
+    disposal_ = 0;
+
+    int transparent = -1;
+    int disposal = 0;
+    delay_ = 0;
+    while (pos_ < size_) {
+      const uint8_t block = data_[pos_++];
+      if (block == 0x3B) {
+        return false;
+      }
+      if (block == 0x21) {
+        Need(1);
+        const uint8_t label = data_[pos_++];
+        if (label == 0xF9) {
+          Need(6);
+          const uint8_t packed = data_[pos_ + 1];
+          disposal = (packed >> 2) & 0x07;
+          delay_ = ReadWord(pos_ + 2) * 10;
+          transparent = (packed & 0x01) ? data_[pos_ + 4] : -1;
+        } else if (label == 0xFF) {
+          Need(16);
+          if (data_[pos_] == 11 && std::memcmp(&data_[pos_ + 1], "NETSCAPE2.0", 11) == 0 &&
+              data_[pos_ + 12] == 3 && data_[pos_ + 13] == 1) {
+            loops_ = ReadWord(pos_ + 14);
+          }
+        }
+        SkipSubBlocks();
+      } else if (block == 0x2C) {
+        DecodeFrame(transparent, disposal);
+        return true;
+      } else {
+        throw InvalidImageFile();
+      }
+    }
+    // Some encoders omit the trailer
+    return false;
+  }
+
+private:
+  static constexpr int kMaxCodes = 4096;
+
+  const uint8_t *data_;
+  std::size_t size_;
+  std::size_t pos_ = 0;
+  int width_ = 0, height_ = 0;
+  int delay_ = 0;
+  int loops_ = 0;
+  std::vector<uint8_t> global_table_;
+  std::vector<uint8_t> canvas_, background_, previous_;
+  std::vector<uint8_t> indices_;
+
+  // Area and disposal method of the last frame
+  int frame_x_ = 0, frame_y_ = 0, frame_w_ = 0, frame_h_ = 0;
+  int disposal_ = 0;
+
+  void Need(std::size_t count) const {
+    if (pos_ + count > size_) {
+      throw InvalidImageFile();
+    }
+  }
+
+  int ReadWord(std::size_t at) const {
+    return data_[at] | (data_[at + 1] << 8);
+  }
+
+  std::vector<uint8_t> ReadColorTable(int size_bits) {
+    const std::size_t length = 3u << (size_bits + 1);
+    Need(length);
+    std::vector<uint8_t> table(data_ + pos_, data_ + pos_ + length);
+    pos_ += length;
+    return table;
+  }
+
+  void SkipSubBlocks() {
+    while (true) {
+      Need(1);
+      const uint8_t length = data_[pos_++];
+      if (length == 0) {
+        return;
+      }
+      Need(length);
+      pos_ += length;
+    }
+  }
+
+  void DecodeFrame(int transparent, int disposal) {
+    Need(9);
+    const int x = ReadWord(pos_), y = ReadWord(pos_ + 2);
+    const int w = ReadWord(pos_ + 4), h = ReadWord(pos_ + 6);
+    const uint8_t packed = data_[pos_ + 8];
+    pos_ += 9;
+    const std::vector<uint8_t> local_table = (packed & 0x80)
+      ? ReadColorTable(packed & 0x07) : std::vector<uint8_t>();
+    const std::vector<uint8_t>& table = (packed & 0x80) ? local_table : global_table_;
+
+    // The descriptor is trusted no more than the screen
+    if (static_cast<uint64_t>(w) * h > MaxImagePixels) {
+      throw InvalidImageFile();
+    }
+    indices_.assign(static_cast<std::size_t>(w) * h, 0);
+    DecodeLZW();
+
+    // Frames may hang off the logical screen: clip them
+    frame_x_ = std::min(x, width_);
+    frame_y_ = std::min(y, height_);
+    frame_w_ = std::min(w, width_ - frame_x_);
+    frame_h_ = std::min(h, height_ - frame_y_);
+    disposal_ = disposal;
+    if (disposal_ == 3) {
+      previous_ = canvas_;
+    }
+
+    // Interlaced rows come in four passes
+    std::vector<int> rows;
+    rows.reserve(h);
+    if (packed & 0x40) {
+      for (int start : {0, 4, 2, 1}) {
+        for (int r = start; r < h; r += (start == 0 ? 8 : start * 2)) {
+          rows.push_back(r);
+        }
+      }
+    } else {
+      for (int r = 0; r < h; ++r) {
+        rows.push_back(r);
+      }
+    }
+
+    for (int i = 0; i < h; ++i) {
+      const int row = rows[i];
+      if (row >= frame_h_) {
+        continue;
+      }
+      const uint8_t *src = &indices_[static_cast<std::size_t>(i) * w];
+      uint8_t *dst = &canvas_[3 * ((static_cast<std::size_t>(frame_y_ + row)) * width_ + frame_x_)];
+      for (int j = 0; j < frame_w_; ++j, dst += 3) {
+        const int index = src[j];
+        if (index == transparent) {
+          continue;
+        }
+        if (3u * index + 2 < table.size()) {
+          std::memcpy(dst, &table[3 * index], 3);
+        } else {
+          dst[0] = dst[1] = dst[2] = 0;
+        }
+      }
+    }
+  }
+
+  // Fills indices_ with the color indices of the frame. Strings are written
+  // back to front by walking the prefix chain, so no stack is needed.
+  // Truncated streams leave the remaining pixels at index 0.
+  void DecodeLZW() {
+    Need(1);
+    const int min_code_size = data_[pos_++];
+    if (min_code_size < 1 || min_code_size > 11) {
+      throw InvalidImageFile();
+    }
+    const int clear = 1 << min_code_size;
+    const int end = clear + 1;
+
+    uint16_t prefix[kMaxCodes];
+    uint8_t suffix[kMaxCodes];
+    uint8_t first[kMaxCodes];
+    uint16_t length[kMaxCodes];
+    for (int c = 0; c < clear; ++c) {
+      prefix[c] = 0;
+      suffix[c] = first[c] = static_cast<uint8_t>(c);
+      length[c] = 1;
+    }
+
+    int code_size = min_code_size + 1;
+    int next = clear + 2;
+    int prev = -1;
+    uint32_t bits = 0;
+    int bit_count = 0;
+    std::size_t out = 0;
+    const std::size_t total = indices_.size();
+    bool done = false;
+
+    while (true) {
+      Need(1);
+      const uint8_t block_length = data_[pos_++];
+      if (block_length == 0) {
+        break;
+      }
+      Need(block_length);
+      const uint8_t *block = data_ + pos_;
+      pos_ += block_length;
+      for (int b = 0; b < block_length && !done; ++b) {
+        bits |= static_cast<uint32_t>(block[b]) << bit_count;
+        bit_count += 8;
+        while (bit_count >= code_size && !done) {
+          const int code = bits & ((1 << code_size) - 1);
+          bits >>= code_size;
+          bit_count -= code_size;
+
+          if (code == clear) {
+            code_size = min_code_size + 1;
+            next = clear + 2;
+            prev = -1;
+            continue;
+          }
+          if (code == end) {
+            done = true;
+            break;
+          }
+
+          int emit = code;
+          if (prev < 0) {
+            if (code >= clear) {
+              throw InvalidImageFile();
+            }
+          } else {
+            if (code > next || (code == next && next >= kMaxCodes)) {
+              throw InvalidImageFile();
+            }
+            if (next < kMaxCodes) {
+              // KwKwK: the new string is prev + first(prev)
+              const uint8_t head = (code == next) ? first[prev] : first[code];
+              prefix[next] = prev;
+              suffix[next] = head;
+              first[next] = first[prev];
+              length[next] = length[prev] + 1;
+              ++next;
+              if (next == (1 << code_size) && code_size < 12) {
+                ++code_size;
+              }
+            }
+          }
+
+          // Write the string of `emit` back to front
+          const std::size_t len = length[emit];
+          std::size_t at = out + len;
+          for (int c = emit; at > out; c = prefix[c]) {
+            --at;
+            if (at < total) {
+              indices_[at] = suffix[c];
+            }
+          }
+          out += len;
+          prev = code;
+          if (out >= total) {
+            done = true;
+          }
+        }
+      }
+    }
+  }
+};
+
+} // namespace detail
+
+//********************************* Image ***********************************//
+
+class AnimatedImage;
+
+class Image {
+public:
+  Image(const std::string& path,
+        ColorConversion conversion = Average,
+        ColorStorage storage = DiscardColor)
+      : conversion_(conversion)
+      , storage_(storage) {
+    MappedFile file(path);
+    Decode(file.GetData(), file.GetSize());
+  }
+
+  Image(const uint8_t *data,
+        std::size_t size,
+        ColorConversion conversion = Average,
+        ColorStorage storage = DiscardColor)
+      : conversion_(conversion)
+      , storage_(storage) {
+    Decode(data, size);
+  }
+
+  Image(int width, int height, uint8_t level = 0)
+      : width_(width)
+      , height_(height)
+      , conversion_(Average)
+      , storage_(DiscardColor) {
+    if (width <= 0 || height <= 0) {
+      throw InvalidPlotSize();
+    }
+    img_.assign(static_cast<std::size_t>(width) * height, level);
+  }
+
+  // Grey levels given row by row, top row first
+  Image(int width, int height, const std::vector<uint8_t>& levels)
+      : Image(width, height) {
+    if (levels.size() != img_.size()) {
+      throw InconsistentData();
+    }
+    for (int i = 0; i < height_; ++i) {
+      std::copy_n(levels.begin() + static_cast<std::size_t>(i) * width_, width_,
+                  img_.begin() + static_cast<std::size_t>(height_ - 1 - i) * width_);
+    }
+  }
+
+  // As above, taking over the buffer instead of copying it
+  Image(int width, int height, std::vector<uint8_t>&& levels)
+      : width_(width)
+      , height_(height)
+      , conversion_(Average)
+      , storage_(DiscardColor) {
+    if (width <= 0 || height <= 0) {
+      throw InvalidPlotSize();
+    }
+    if (levels.size() != static_cast<std::size_t>(width) * height) {
+      throw InconsistentData();
+    }
+    img_ = std::move(levels);
+    for (int i = 0; i < height_ / 2; ++i) {
+      const auto row = img_.begin() + static_cast<std::size_t>(i) * width_;
+      std::swap_ranges(row, row + width_,
+                       img_.begin() + static_cast<std::size_t>(height_ - 1 - i) * width_);
+    }
+  }
+  
   int GetWidth() const { return width_; }
   int GetHeight() const { return height_; }
+  bool HasColor() const { return !rgb_.empty(); }
+
+  // Color of a pixel, not set if the image has no color
+  Color GetColor(int x, int y) const {
+    if (rgb_.empty()) {
+      return {};
+    }
+    const uint8_t *rgb = &rgb_[3 * (x + static_cast<std::size_t>(y) * width_)];
+    return Color(rgb[0], rgb[1], rgb[2]);
+  }
+
+  // Writing through the returned reference is not seen by the copies kept
+  // by Resized, use Set instead
+  uint8_t& At(int x, int y) { return img_[x + y * width_]; }
+
+  const uint8_t& At(int x, int y) const { return img_[x + y * width_]; }
+
+  Image& Set(int x, int y, uint8_t level) {
+    resized_.Clear();
+    img_[x + y * width_] = level;
+    return *this;
+  }
+
+  Image& Invert() {
+    resized_.Clear();
+    std::transform(img_.begin(), img_.end(), img_.begin(),
+      [](uint8_t level) -> uint8_t { return 255 - level; });
+    std::transform(rgb_.begin(), rgb_.end(), rgb_.begin(),
+      [](uint8_t level) -> uint8_t { return 255 - level; });
+    return *this;
+  }
+
+  Image& Resize(const ResizePlan& plan) {
+    img_ = Resample(img_, 1, plan);
+    if (!rgb_.empty()) {
+      rgb_ = Resample(rgb_, 3, plan);
+    }
+    width_ = plan.GetWidth();
+    height_ = plan.GetHeight();
+    resized_.Clear();
+    return *this;
+  }
+
+  Image& Resize(int new_width, int new_height) {
+    if (new_width == width_ && new_height == height_) {
+      return *this;
+    }
+    return Resize(ResizePlan(width_, height_, new_width, new_height));
+  }
+
+  Image& Resize(double ratio) {
+    if (ratio <= 0.0) {
+      throw InvalidPlotSize();
+    }
+    return Resize(std::max<int>(1, std::lround(width_ * ratio)),
+                  std::max<int>(1, std::lround(height_ * ratio)));
+  }
+
+  // Returns this image resized, reusing the copies made by the last few
+  // calls. Repeatedly drawing the same image at the same size then costs
+  // neither a copy nor a resampling. Modifying the image drops the copies,
+  // but those already returned stay valid. At the current size, the result
+  // points to this image itself. Safe to call from several threads.
+  std::shared_ptr<const Image> Resized(int new_width, int new_height) const {
+    if (new_width == width_ && new_height == height_) {
+      return std::shared_ptr<const Image>(std::shared_ptr<const Image>(), this);
+    }
+    if (auto cached = resized_.Find(new_width, new_height)) {
+      return cached;
+    }
+
+    // Resampled outside the lock, a concurrent call may do the same
+    const ResizePlan plan(width_, height_, new_width, new_height);
+    auto variant = std::make_shared<Image>(new_width, new_height);
+    variant->img_ = Resample(img_, 1, plan);
+    if (!rgb_.empty()) {
+      variant->rgb_ = Resample(rgb_, 3, plan);
+    }
+    resized_.Insert(variant);
+    return variant;
+  }
+
+private:
+  friend class AnimatedImage;
+
+  std::vector<uint8_t> img_;
+  std::vector<uint8_t> rgb_;
+  int width_, height_;
+  ColorConversion conversion_;
+  ColorStorage storage_;
+
+  // Most recently used resized copies. Copies of the image start empty.
+  class ResizeCache {
+  public:
+    ResizeCache() = default;
+    ResizeCache(const ResizeCache&) {}
+    ResizeCache& operator=(const ResizeCache&) {
+      Clear();
+      return *this;
+    }
+
+    std::shared_ptr<const Image> Find(int width, int height) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if ((*it)->width_ == width && (*it)->height_ == height) {
+          std::rotate(entries_.begin(), it, it + 1);
+          return entries_.front();
+        }
+      }
+      return nullptr;
+    }
+
+    void Insert(std::shared_ptr<const Image> variant) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (entries_.size() == kSize) {
+        entries_.pop_back();
+      }
+      entries_.insert(entries_.begin(), std::move(variant));
+    }
+
+    void Clear() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      entries_.clear();
+    }
+
+  private:
+    static constexpr std::size_t kSize = 4;
+
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<const Image>> entries_;
+  };
+
+  mutable ResizeCache resized_;
+
+  // Resamples a plane of interleaved channels
+  std::vector<uint8_t> Resample(const std::vector<uint8_t>& plane,
+                                int channels,
+                                const ResizePlan& plan) const {
+    if (plan.GetSourceWidth() != width_ || plan.GetSourceHeight() != height_) {
+      throw InconsistentData();
+    }
+    // 255 * width * height must fit in the accumulator
+    if (static_cast<uint64_t>(width_) * height_ <= (1u << 24)) {
+      return ResampleWithTable<uint32_t>(plane, channels, plan);
+    }
+    return ResampleWithTable<uint64_t>(plane, channels, plan);
+  }
+
+  // Every destination pixel is the mean of its source box, read in O(1)
+  // from a summed-area table regardless of the box size.
+  template<class Acc>
+  std::vector<uint8_t> ResampleWithTable(const std::vector<uint8_t>& plane,
+                                         int channels,
+                                         const ResizePlan& plan) const {
+    const int new_width = plan.GetWidth();
+    const int new_height = plan.GetHeight();
+    std::vector<uint8_t> resized(static_cast<std::size_t>(new_width) * new_height * channels);
+
+    const int sat_width = width_ + 1;
+    std::vector<Acc> sat(static_cast<std::size_t>(sat_width) * (height_ + 1));
+    for (int c = 0; c < channels; ++c) {
+      for (int y = 0; y < height_; ++y) {
+        const uint8_t *src = &plane[static_cast<std::size_t>(y) * width_ * channels + c];
+        const Acc *above = &sat[static_cast<std::size_t>(y) * sat_width];
+        Acc *current = &sat[static_cast<std::size_t>(y + 1) * sat_width];
+        Acc row_sum = 0;
+        for (int x = 0; x < width_; ++x) {
+          row_sum += src[x * channels];
+          current[x + 1] = above[x + 1] + row_sum;
+        }
+      }
 
-  int& At(int x, int y) { return img_[x + y * width_]; }
-  const int& At(int x, int y) const { return img_[x + y * width_]; }
+      detail::ParallelFor(0, new_height, std::max(1, (1 << 16) / new_width), [&](int row_beg, int row_end) {
+        for (int i = row_beg; i < row_end; ++i) {
+          const int y0 = plan.GetRowBegin(i);
+          const int y1 = plan.GetRowEnd(i);
+          const Acc *top = &sat[static_cast<std::size_t>(y0) * sat_width];
+          const Acc *bottom = &sat[static_cast<std::size_t>(y1) * sat_width];
+          uint8_t *dst = &resized[static_cast<std::size_t>(i) * new_width * channels + c];
+          for (int j = 0; j < new_width; ++j) {
+            const int x0 = plan.GetColumnBegin(j);
+            const int x1 = plan.GetColumnEnd(j);
+            const Acc sum = bottom[x1] - bottom[x0] - top[x1] + top[x0];
+            dst[j * channels] = sum / (static_cast<Acc>(x1 - x0) * (y1 - y0));
+          }
+        }
+      });
+    }
 
-  Image& Invert() {
-    std::transform(img_.begin(), img_.end(), img_.begin(),
-      [](int level) { return 255 - level; });
-    return *this;
+    return resized;
   }
 
-  Image& Resize(int new_width, int new_height) {
-    if (new_width > width_ || new_height > height_) {
-      return *this;
+  bool CheckFormat(const std::string& fmt) {
+    if (fmt == "BM" || fmt == "BA" || fmt == "CI" || fmt == "CP" ||
+        fmt == "IC" || fmt == "PC") {
+      return true;
     }
+    return false;
+  }
 
-    std::vector<double> sums(new_width * new_height);
+  void Decode(const uint8_t *data, std::size_t size) {
+    if (data != nullptr && detail::IsNetpbm(data, size)) {
+      DecodeNetpbm(data, size);
+    } else if (data != nullptr && detail::GifDecoder::IsGif(data, size)) {
+      // Only the first frame, see AnimatedImage for the others
+      detail::GifDecoder gif(data, size);
+      if (!gif.NextFrame()) {
+        throw InvalidImageFile();
+      }
+      AssignRGB(gif.GetWidth(), gif.GetHeight(), gif.GetCanvas().data());
+    } else {
+      DecodeBMP(data, size);
+    }
+  }
 
-    const int div_w = width_ / new_width;
-    const int div_h = height_ / new_height;
-    const int rem_w = width_ % new_width;
-    const int rem_h = height_ % new_height;
-    int block_i_offset = 0;
+  void DecodeNetpbm(const uint8_t *data, std::size_t size) {
+    detail::NetpbmHeader header;
+    if (!detail::ParseNetpbmHeader(data, size, header)) {
+      throw InvalidImageFile();
+    }
+    // Bound the image by the payload before allocating it. ASCII samples
+    // take a digit and a separator, but for packed bitmaps.
+    const std::size_t payload = size - header.payload_offset;
+    const int channels = header.GetChannels();
+    if (header.IsBinary()) {
+      if (header.GetStride() > payload / header.height) {
+        throw InvalidImageFile();
+      }
+    } else {
+      const std::size_t sample_bytes = (header.format == 1) ? 1 : 2;
+      const std::size_t row_samples = static_cast<std::size_t>(header.width) * channels;
+      if (row_samples > (payload + 1) / sample_bytes / header.height) {
+        throw InvalidImageFile();
+      }
+    }
+    width_ = header.width;
+    height_ = header.height;
+    img_.resize(static_cast<std::size_t>(width_) * height_);
+    const bool color = channels == 3 && storage_ == KeepColor;
+    if (color) {
+      rgb_.resize(img_.size() * 3);
+    }
 
-    for (int i = 0; i < new_height; ++i) {
-      const int block_i_len = div_h + (i < rem_h);
-      int block_j_offset = 0;
-      for (int j = 0; j < new_width; ++j) {
-        const int block_j_len = div_w + (j < rem_w);
-        const int sums_idx = j + i * new_width;
-        for (int block_i = 0; block_i < block_i_len; ++block_i) {
-          for (int block_j = 0; block_j < block_j_len; ++block_j) {
-            sums[sums_idx] += At(block_j_offset + block_j, block_i_offset + block_i);
+    // Samples are normalized to 8 bits, bitmaps use 1 for black. They are
+    // decoded straight into the image, or used in place if already 8-bit
+    // RGB, so only grey-only storage of other RGB payloads needs a row.
+    const bool in_place = header.IsBinary() && header.maxval == 255;
+    std::vector<uint8_t> scratch;
+    if (channels == 3 && !color && !in_place) {
+      scratch.resize(static_cast<std::size_t>(width_) * channels);
+    }
+    std::size_t pos = header.payload_offset;
+    for (int i = 0; i < height_; ++i) {
+      // Netpbm rows are top-down, ours are bottom-up like BMP
+      const std::size_t row = static_cast<std::size_t>(height_ - 1 - i) * width_;
+      uint8_t *samples = (channels == 1) ? &img_[row]
+                       : color           ? &rgb_[3 * row]
+                                         : scratch.data();
+      const uint8_t *pixels = samples;
+      if (header.IsBinary()) {
+        if (channels == 3 && !color && in_place) {
+          pixels = data + pos;
+        } else {
+          ReadNetpbmRow(data + pos, header, samples);
+        }
+        pos += header.GetStride();
+      } else {
+        for (int j = 0; j < width_ * channels; ++j) {
+          int value = 0;
+          if (!detail::SkipNetpbmSpaces(data, size, pos)) {
+            throw InvalidImageFile();
           }
+          if (header.format == 1) {
+            // Plain bitmaps may pack their digits without separators
+            value = data[pos++] - '0';
+          } else {
+            detail::ReadNetpbmNumber(data, size, pos, value);
+          }
+          samples[j] = ScaleNetpbmSample(value, header);
         }
-        sums[sums_idx] /= static_cast<double>(block_i_len * block_j_len);
-        block_j_offset += block_j_len;
       }
-      block_i_offset += block_i_len;
+      if (channels == 3) {
+        detail::PixelsToGrey(pixels, &img_[row], width_, 3, conversion_, detail::OrderRGB);
+      }
     }
+  }
 
-    img_.resize(sums.size());
-    std::transform(sums.begin(),
-                   sums.end(),
-                   img_.begin(),
-                   [](double x) -> int { return x;});
-
-    width_ = new_width;
-    height_ = new_height;
+  // Takes RGB pixels given row by row, top row first
+  void AssignRGB(int width, int height, const uint8_t *rgb) {
+    width_ = width;
+    height_ = height;
+    img_.resize(static_cast<std::size_t>(width_) * height_);
+    if (storage_ == KeepColor) {
+      rgb_.resize(img_.size() * 3);
+    }
+    for (int i = 0; i < height_; ++i) {
+      const uint8_t *src = rgb + 3 * static_cast<std::size_t>(i) * width_;
+      const std::size_t row = static_cast<std::size_t>(height_ - 1 - i) * width_;
+      detail::PixelsToGrey(src, &img_[row], width_, 3, conversion_, detail::OrderRGB);
+      if (storage_ == KeepColor) {
+        std::copy_n(src, 3 * width_, rgb_.begin() + 3 * row);
+      }
+    }
+    resized_.Clear();
+  }
 
-    return *this;
+  static uint8_t ScaleNetpbmSample(int value, const detail::NetpbmHeader& header) {
+    if (value < 0 || value > header.maxval) {
+      throw InvalidImageFile();
+    }
+    if (header.format == 1 || header.format == 4) {
+      return value ? 0 : 255;
+    }
+    return static_cast<uint8_t>((value * 255 + header.maxval / 2) / header.maxval);
   }
 
-  Image& Resize(double ratio) {
-    if (ratio >= 1.0) {
-      return *this;
+  static void ReadNetpbmRow(const uint8_t *src, const detail::NetpbmHeader& header, uint8_t *dst) {
+    const int n = header.width * header.GetChannels();
+    if (header.format == 4) {
+      for (int j = 0; j < n; ++j) {
+        dst[j] = (src[j / 8] & (0x80 >> (j % 8))) ? 0 : 255;
+      }
+    } else if (header.maxval == 255) {
+      std::memcpy(dst, src, n);
+    } else if (header.GetBytesPerSample() == 1) {
+      for (int j = 0; j < n; ++j) {
+        dst[j] = ScaleNetpbmSample(src[j], header);
+      }
+    } else {
+      for (int j = 0; j < n; ++j) {
+        dst[j] = ScaleNetpbmSample((src[2 * j] << 8) | src[2 * j + 1], header);
+      }
     }
-    return *this;
   }
 
-private:
-  std::vector<int> img_;
-  std::vector<uint8_t> raw_;
-  int width_, height_;
-  BMPImage *data_ = nullptr;
+  void DecodeBMP(const uint8_t *data, std::size_t size) {
+    constexpr std::size_t header_size = 2 + sizeof(BMPImage);
+    if (data == nullptr || size < header_size) {
+      throw InvalidImageFile();
+    }
+    if (!CheckFormat(std::string(reinterpret_cast<const char*>(data), 2))) {
+      throw BMPFormatNotSupported();
+    }
 
-  bool CheckFormat(const std::string& fmt) {
-    if (fmt == "BM" || fmt == "BA" || fmt == "CI" || fmt == "CP" ||
-        fmt == "IC" || fmt == "PC") {
-      return true;
+    BMPImage header;
+    std::memcpy(&header, data + 2, sizeof(BMPImage));
+    if (header.header_length < 40 || header.offset < 0) {
+      throw InvalidImageFile();
     }
-    return false;
+    if (header.height <= 0 || header.width <= 0) {
+      throw BMPFormatNotSupported();
+    }
+    if (header.compression != 0 && header.compression != 3) {
+      throw BMPFormatNotSupported();
+    }
+    const int bpp = header.bits_per_pixel;
+    if (bpp != 1 && bpp != 4 && bpp != 8 && bpp != 24 && bpp != 32) {
+      throw BMPFormatNotSupported();
+    }
+    if (static_cast<uint64_t>(header.width) * header.height > MaxImagePixels) {
+      throw InvalidImageFile();
+    }
+
+    // Rows are padded to a multiple of four bytes
+    const uint64_t stride = (static_cast<uint64_t>(header.width) * bpp + 31) / 32 * 4;
+    if (static_cast<uint64_t>(header.offset) > size ||
+        stride > (size - header.offset) / header.height) {
+      throw InvalidImageFile();
+    }
+
+    width_ = header.width;
+    height_ = header.height;
+    img_.resize(static_cast<std::size_t>(width_) * height_);
+
+    if (header.bits_per_pixel == 4 || header.bits_per_pixel == 8) {
+      // The color table follows the info header, one BGRA quad per entry
+      const uint64_t palette_begin = 14 + static_cast<uint64_t>(header.header_length);
+      const int max_colors = 1 << header.bits_per_pixel;
+      const int colors = (header.colors > 0 && header.colors < max_colors) ? header.colors : max_colors;
+      if (palette_begin + 4 * colors > size) {
+        throw InvalidImageFile();
+      }
+      ParsePayloadIndexed(data + header.offset, stride, header.bits_per_pixel,
+                          data + palette_begin, colors);
+      return;
+    }
+
+    ParsePayload(data + header.offset, stride, header.bits_per_pixel);
   }
 
-  void ParsePayload() {
-    switch (data_->bits_per_pixel) {
+  void ParsePayload(const uint8_t *payload, std::size_t stride, int bits_per_pixel) {
+    switch (bits_per_pixel) {
       case 1:
-        ParsePayload_1();
+        ParsePayload_1(payload, stride);
         break;
       case 24:
-        ParsePayload_24();
+        ParsePayload_24(payload, stride);
         break;
       case 32:
-        ParsePayload_32();
+        ParsePayload_32(payload, stride);
         break;
       default:;
         throw BMPFormatNotSupported();
     }
   }
 
-  void ParsePayload_1() {
-    uint8_t *current = &(raw_.data()[data_->offset]);
+  void ParsePayload_1(const uint8_t *payload, std::size_t stride) {
     int img_idx = 0;
     const int full_bytes = width_ / 8;
     const int residual_bits = width_ - full_bytes * 8;
-    const int skip = residual_bits / 8;
     for (int i = 0; i < height_; ++i) {
+      const uint8_t *current = payload + i * stride;
       uint8_t temp;
       for (int j = 0; j < full_bytes; ++j) {
         temp = *current;
@@ -818,60 +2830,809 @@ private:
         img_[img_idx++] = !!(temp & 0x01) * 255;
         ++current;
       }
-      temp = *current;
-      uint8_t mask = 0x80;
-      for (int j = 0; j < residual_bits; ++j) {
-        img_[img_idx++] = !!(temp & mask) * 255;
-        mask >>= 1;
+      temp = *current;
+      uint8_t mask = 0x80;
+      for (int j = 0; j < residual_bits; ++j) {
+        img_[img_idx++] = !!(temp & mask) * 255;
+        mask >>= 1;
+      }
+    }
+  }
+
+  // Out-of-range indices map to the zeroed tail of the tables
+  void ParsePayloadIndexed(const uint8_t *payload,
+                           std::size_t stride,
+                           int bits_per_pixel,
+                           const uint8_t *palette,
+                           int colors) {
+    std::vector<uint8_t> bgr(static_cast<std::size_t>(colors) * 3);
+    for (int i = 0; i < colors; ++i) {
+      std::memcpy(&bgr[3 * i], palette + 4 * i, 3);
+    }
+    uint8_t palette_grey[256] = {};
+    uint8_t palette_rgb[256 * 3] = {};
+    detail::PixelsToGrey(bgr.data(), palette_grey, colors, 3, conversion_);
+    detail::PixelsToRGB(bgr.data(), palette_rgb, colors, 3);
+
+    if (storage_ == KeepColor) {
+      rgb_.resize(img_.size() * 3);
+    }
+    for (int i = 0; i < height_; ++i) {
+      const uint8_t *current = payload + i * stride;
+      const std::size_t row = static_cast<std::size_t>(i) * width_;
+      for (int j = 0; j < width_; ++j) {
+        const uint8_t index = (bits_per_pixel == 8)
+          ? current[j]
+          : (current[j / 2] >> ((j % 2) ? 0 : 4)) & 0x0F;
+        img_[row + j] = palette_grey[index];
+        if (storage_ == KeepColor) {
+          std::memcpy(&rgb_[3 * (row + j)], &palette_rgb[3 * index], 3);
+        }
+      }
+    }
+  }
+
+  void ParsePayload_24(const uint8_t *payload, std::size_t stride) {
+    ParsePayloadBGR(payload, stride, 3);
+  }
+
+  void ParsePayload_32(const uint8_t *payload, std::size_t stride) {
+    ParsePayloadBGR(payload, stride, 4);
+  }
+
+  void ParsePayloadBGR(const uint8_t *payload, std::size_t stride, int bytes_per_pixel) {
+    if (storage_ == KeepColor) {
+      rgb_.resize(img_.size() * 3);
+    }
+    for (int i = 0; i < height_; ++i) {
+      const std::size_t row = static_cast<std::size_t>(i) * width_;
+      detail::PixelsToGrey(payload + i * stride, &img_[row], width_, bytes_per_pixel, conversion_);
+      if (storage_ == KeepColor) {
+        detail::PixelsToRGB(payload + i * stride, &rgb_[3 * row], width_, bytes_per_pixel);
+      }
+    }
+  }
+};
+
+//***************************** AnimatedImage *******************************//
+
+// All the frames of a GIF, decoded once and composited, so that playback
+// only has to cycle through them. Resize() resamples every frame ahead of
+// time with a single plan.
+class AnimatedImage {
+public:
+  AnimatedImage(const std::string& path,
+                ColorConversion conversion = Average,
+                ColorStorage storage = DiscardColor) {
+    MappedFile file(path);
+    Decode(file.GetData(), file.GetSize(), conversion, storage);
+  }
+
+  AnimatedImage(const uint8_t *data,
+                std::size_t size,
+                ColorConversion conversion = Average,
+                ColorStorage storage = DiscardColor) {
+    Decode(data, size, conversion, storage);
+  }
+
+  int GetWidth() const { return frames_.front().GetWidth(); }
+  int GetHeight() const { return frames_.front().GetHeight(); }
+  int GetFrameCount() const { return frames_.size(); }
+  const Image& GetFrame(int index) const { return frames_.at(index); }
+
+  // Display time of a frame in milliseconds, 0 if the file leaves it unset
+  int GetDelay(int index) const { return delays_.at(index); }
+
+  // Number of times the animation repeats, 0 meaning forever
+  int GetLoopCount() const { return loops_; }
+
+  AnimatedImage& Resize(int new_width, int new_height) {
+    if (new_width == GetWidth() && new_height == GetHeight()) {
+      return *this;
+    }
+    const ResizePlan plan(GetWidth(), GetHeight(), new_width, new_height);
+    for (auto& frame : frames_) {
+      frame.Resize(plan);
+    }
+    return *this;
+  }
+
+  AnimatedImage& Invert() {
+    for (auto& frame : frames_) {
+      frame.Invert();
+    }
+    return *this;
+  }
+
+private:
+  std::vector<Image> frames_;
+  std::vector<int> delays_;
+  int loops_ = 0;
+
+  void Decode(const uint8_t *data,
+              std::size_t size,
+              ColorConversion conversion,
+              ColorStorage storage) {
+    if (data == nullptr || !detail::GifDecoder::IsGif(data, size)) {
+      throw InvalidImageFile();
+    }
+    detail::GifDecoder gif(data, size);
+    while (gif.NextFrame()) {
+      frames_.emplace_back(gif.GetWidth(), gif.GetHeight());
+      frames_.back().conversion_ = conversion;
+      frames_.back().storage_ = storage;
+      frames_.back().AssignRGB(gif.GetWidth(), gif.GetHeight(), gif.GetCanvas().data());
+      delays_.push_back(gif.GetDelay());
+    }
+    if (frames_.empty()) {
+      throw InvalidImageFile();
+    }
+    loops_ = gif.GetLoopCount();
+  }
+};
+
+//***************************** ImageSequence *******************************//
+
+// Frames read from a file or a pipe holding either concatenated binary
+// PBM/PGM/PPM images or a YUV4MPEG2 stream, of which only the luma plane
+// is kept. Frames are decoded on a background thread, at most two ahead
+// of the consumer.
+class ImageSequence {
+public:
+  // "-" reads from the standard input
+  ImageSequence(const std::string& path, ColorConversion conversion = Average)
+      : conversion_(conversion) {
+    if (path == "-") {
+      fd_ = STDIN_FILENO;
+    } else {
+      fd_ = open(path.c_str(), O_RDONLY);
+      owns_fd_ = true;
+    }
+    if (fd_ < 0) {
+      throw FileNotReadable();
+    }
+    Start();
+  }
+
+  // The descriptor is not closed by the sequence
+  ImageSequence(int fd, ColorConversion conversion = Average)
+      : fd_(fd)
+      , conversion_(conversion) {
+    Start();
+  }
+
+  ImageSequence(const ImageSequence&) = delete;
+  ImageSequence& operator=(const ImageSequence&) = delete;
+
+  ~ImageSequence() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    decoder_.join();
+    if (owns_fd_) {
+      close(fd_);
+    }
+  }
+
+  // Blocks until the next frame is decoded. Returns nullptr once the
+  // stream ends and rethrows any error met while decoding.
+  std::unique_ptr<Image> Next() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return !frames_.empty() || finished_; });
+    if (frames_.empty()) {
+      if (error_) {
+        std::rethrow_exception(error_);
+      }
+      return nullptr;
+    }
+    auto frame = std::move(frames_.front());
+    frames_.pop_front();
+    cv_.notify_all();
+    return frame;
+  }
+
+  // Frame rate declared by a YUV4MPEG2 stream, 0 if unknown
+  double GetFrameRate() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return frame_rate_;
+  }
+
+private:
+  static constexpr std::size_t kQueueLength = 2;
+  static constexpr int kPollTimeoutMs = 50;
+
+  int fd_;
+  bool owns_fd_ = false;
+  ColorConversion conversion_;
+  std::vector<uint8_t> buffer_;
+  std::size_t begin_ = 0;
+  bool eof_ = false;
+
+  // Y4M stream state
+  bool y4m_ = false;
+  int y4m_width_ = 0, y4m_height_ = 0;
+  std::size_t y4m_chroma_size_ = 0;
+
+  std::thread decoder_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::unique_ptr<Image>> frames_;
+  bool stop_ = false;
+  bool finished_ = false;
+  std::exception_ptr error_;
+  double frame_rate_ = 0.0;
+
+  void Start() {
+    decoder_ = std::thread([this] { Decode(); });
+  }
+
+  void Decode() {
+    try {
+      while (auto frame = ReadFrame()) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return frames_.size() < kQueueLength || stop_; });
+        if (stop_) {
+          break;
+        }
+        frames_.push_back(std::move(frame));
+        cv_.notify_all();
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      error_ = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+    cv_.notify_all();
+  }
+
+  bool Stopping() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stop_;
+  }
+
+  std::size_t Buffered() const { return buffer_.size() - begin_; }
+  const uint8_t* Data() const { return buffer_.data() + begin_; }
+
+  // Reads until at least `count` bytes are buffered. Returns false if the
+  // stream ends or the sequence is destroyed first.
+  bool Fill(std::size_t count) {
+    if (begin_ > 0 && begin_ >= buffer_.size() / 2) {
+      buffer_.erase(buffer_.begin(), buffer_.begin() + begin_);
+      begin_ = 0;
+    }
+    while (Buffered() < count && !eof_) {
+      // Polling lets a blocked pipe notice the destructor
+      pollfd pfd = {fd_, POLLIN, 0};
+      const int ready = poll(&pfd, 1, kPollTimeoutMs);
+      if (Stopping()) {
+        return false;
+      }
+      if (ready == 0 || (ready < 0 && errno == EINTR)) {
+        continue;
+      }
+      const std::size_t used = buffer_.size();
+      buffer_.resize(std::max(used + (1 << 16), begin_ + count));
+      const ssize_t n = read(fd_, buffer_.data() + used, buffer_.size() - used);
+      if (n < 0 && errno != EINTR) {
+        throw FileNotReadable();
+      }
+      buffer_.resize(used + std::max<ssize_t>(n, 0));
+      eof_ = (n == 0);
+    }
+    return Buffered() >= count;
+  }
+
+  // Returns nullptr at the end of the stream
+  std::unique_ptr<Image> ReadFrame() {
+    if (!Fill(1)) {
+      return nullptr;
+    }
+    // Concatenated Y4M streams repeat their header
+    if (Data()[0] == 'Y') {
+      ReadY4MHeader();
+    }
+    return y4m_ ? ReadY4MFrame() : ReadNetpbmFrame();
+  }
+
+  std::unique_ptr<Image> ReadNetpbmFrame() {
+    detail::NetpbmHeader header;
+    while (!detail::ParseNetpbmHeader(Data(), Buffered(), header)) {
+      if (!Fill(Buffered() + 1)) {
+        if (Stopping() || Buffered() == 0) {
+          return nullptr;
+        }
+        throw InvalidImageFile();
+      }
+    }
+    if (!header.IsBinary()) {
+      throw BMPFormatNotSupported();
+    }
+    if (static_cast<uint64_t>(header.width) * header.height > MaxImagePixels) {
+      throw InvalidImageFile();
+    }
+    const std::size_t frame_size = header.payload_offset + header.GetStride() * header.height;
+    if (!Fill(frame_size)) {
+      if (Stopping()) {
+        return nullptr;
+      }
+      throw InvalidImageFile();
+    }
+    auto frame = std::make_unique<Image>(Data(), frame_size, conversion_);
+    begin_ += frame_size;
+    // Whitespace may separate concatenated images
+    while (Fill(1) && detail::IsNetpbmSpace(Data()[0])) {
+      ++begin_;
+    }
+    return frame;
+  }
+
+  // Reads a line without its terminating newline
+  bool ReadLine(std::string& line) {
+    std::size_t length = 0;
+    while (true) {
+      const void *newline = std::memchr(Data() + length, '\n', Buffered() - length);
+      if (newline != nullptr) {
+        length = static_cast<const uint8_t*>(newline) - Data();
+        break;
+      }
+      length = Buffered();
+      if (!Fill(Buffered() + 1)) {
+        return false;
+      }
+    }
+    line.assign(reinterpret_cast<const char*>(Data()), length);
+    begin_ += length + 1;
+    return true;
+  }
+
+  void ReadY4MHeader() {
+    std::string line;
+    if (!ReadLine(line) || line.compare(0, 10, "YUV4MPEG2 ") != 0) {
+      throw InvalidImageFile();
+    }
+    std::istringstream tags(line.substr(10));
+    std::string tag, chroma = "420";
+    while (tags >> tag) {
+      const std::string value = tag.substr(1);
+      if (tag[0] == 'W') {
+        y4m_width_ = std::atoi(value.c_str());
+      } else if (tag[0] == 'H') {
+        y4m_height_ = std::atoi(value.c_str());
+      } else if (tag[0] == 'C') {
+        chroma = value;
+      } else if (tag[0] == 'F') {
+        int num = 0, den = 0;
+        if (std::sscanf(value.c_str(), "%d:%d", &num, &den) == 2 && num > 0 && den > 0) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          frame_rate_ = static_cast<double>(num) / den;
+        }
+      }
+    }
+    if (y4m_width_ <= 0 || y4m_height_ <= 0 ||
+        static_cast<uint64_t>(y4m_width_) * y4m_height_ > MaxImagePixels) {
+      throw InvalidImageFile();
+    }
+
+    const std::size_t w = y4m_width_, h = y4m_height_;
+    // 8-bit samples only: 420p10 and the like take two bytes each
+    if (chroma == "420" || chroma == "420jpeg" || chroma == "420paldv" || chroma == "420mpeg2") {
+      y4m_chroma_size_ = 2 * ((w + 1) / 2) * ((h + 1) / 2);
+    } else if (chroma == "422") {
+      y4m_chroma_size_ = 2 * ((w + 1) / 2) * h;
+    } else if (chroma == "411") {
+      y4m_chroma_size_ = 2 * ((w + 3) / 4) * h;
+    } else if (chroma == "444") {
+      y4m_chroma_size_ = 2 * w * h;
+    } else if (chroma == "444alpha") {
+      y4m_chroma_size_ = 3 * w * h;
+    } else if (chroma == "mono") {
+      y4m_chroma_size_ = 0;
+    } else {
+      throw BMPFormatNotSupported();
+    }
+    y4m_ = true;
+  }
+
+  std::unique_ptr<Image> ReadY4MFrame() {
+    std::string line;
+    if (!ReadLine(line)) {
+      if (Stopping() || Buffered() == 0) {
+        return nullptr;
+      }
+      throw InvalidImageFile();
+    }
+    if (line.compare(0, 5, "FRAME") != 0) {
+      throw InvalidImageFile();
+    }
+    const std::size_t luma_size = static_cast<std::size_t>(y4m_width_) * y4m_height_;
+    if (!Fill(luma_size + y4m_chroma_size_)) {
+      if (Stopping()) {
+        return nullptr;
+      }
+      throw InvalidImageFile();
+    }
+    std::vector<uint8_t> luma(Data(), Data() + luma_size);
+    begin_ += luma_size + y4m_chroma_size_;
+    return std::make_unique<Image>(y4m_width_, y4m_height_, std::move(luma));
+  }
+};
+
+//********************************** IPlot **********************************//
+
+class IPlot {
+public:
+  virtual ~IPlot() = default;
+  virtual Brush& At(int col, int row) = 0;
+  virtual const Brush& At(int col, int row) const = 0;
+  virtual std::string Serialize() const = 0;
+  virtual int GetWidth() const = 0;
+  virtual int GetHeight() const = 0;
+protected:
+  int width_;
+  int height_;
+  std::vector<Brush> canvas_;
+};
+
+//********************************** Label **********************************//
+
+// Text to be placed near an anchor cell, centered on it when there is room.
+// Labels with a higher priority are placed first.
+class Label {
+public:
+  Label(const std::string& text, const Position& anchor, int priority = 0)
+      : text_(text)
+      , anchor_(anchor)
+      , priority_(priority) { }
+
+  const std::string& GetText() const { return text_; }
+  const Position& GetAnchor() const { return anchor_; }
+  int GetPriority() const { return priority_; }
+
+private:
+  std::string text_;
+  Position anchor_;
+  int priority_;
+};
+
+namespace detail {
+
+// One bit per canvas cell, rows packed into 64-bit words, so that testing
+// or marking a run of cells costs a few word operations.
+class OccupancyGrid {
+public:
+  OccupancyGrid(int width, int height)
+      : width_(width)
+      , height_(height)
+      , words_per_row_((width + 63) / 64)
+      , bits_(static_cast<std::size_t>(words_per_row_) * height, 0) { }
+
+  void Mark(int col, int row) {
+    bits_[Word(col, row)] |= uint64_t{1} << (col % 64);
+  }
+
+  void Mark(int col_begin, int col_end, int row) {
+    while (col_begin < col_end) {
+      const int count = WordRun(col_begin, col_end);
+      bits_[Word(col_begin, row)] |= Mask(col_begin, count);
+      col_begin += count;
+    }
+  }
+
+  // Whether [col_begin, col_end) on a row is inside the grid and unmarked
+  bool IsFree(int col_begin, int col_end, int row) const {
+    return FreeRun(col_begin, col_end, row) == col_end - col_begin;
+  }
+
+  // Number of unmarked cells from col_begin, up to col_end
+  int FreeRun(int col_begin, int col_end, int row) const {
+    if (row < 0 || row >= height_ || col_begin < 0) {
+      return 0;
+    }
+    col_end = std::min(col_end, width_);
+    int run = 0;
+    while (col_begin < col_end) {
+      const int count = WordRun(col_begin, col_end);
+      const uint64_t mask = Mask(col_begin, count);
+      const uint64_t taken = bits_[Word(col_begin, row)] & mask;
+      if (taken != 0) {
+        // Free cells of this word below the first taken one
+        return run + __builtin_ctzll(taken) - col_begin % 64;
+      }
+      run += count;
+      col_begin += count;
+    }
+    return run;
+  }
+
+private:
+  int width_, height_;
+  int words_per_row_;
+  std::vector<uint64_t> bits_;
+
+  std::size_t Word(int col, int row) const {
+    return static_cast<std::size_t>(row) * words_per_row_ + col / 64;
+  }
+
+  // Cells of [col_begin, col_end) within the word of col_begin
+  static int WordRun(int col_begin, int col_end) {
+    return std::min(64 - col_begin % 64, col_end - col_begin);
+  }
+
+  static uint64_t Mask(int col_begin, int count) {
+    const uint64_t ones = (count == 64) ? ~uint64_t{0} : (uint64_t{1} << count) - 1;
+    return ones << (col_begin % 64);
+  }
+};
+
+} // namespace detail
+
+//***************************** Line breaking *******************************//
+
+namespace detail {
+
+struct Word {
+  std::string text;
+  int width;
+};
+
+// Words of a paragraph, those wider than a line cut into line-sized pieces
+inline std::vector<Word> SplitWords(const std::string& paragraph, int line_width) {
+  std::vector<Word> words;
+  bool in_word = false;
+  ForEachCharacter(paragraph, [&](const char *bytes, std::size_t length, int width) {
+    if (length == 1 && (*bytes == ' ' || *bytes == '\t')) {
+      in_word = false;
+      return;
+    }
+    if (!in_word || words.back().width + width > line_width) {
+      words.push_back({std::string(), 0});
+      in_word = true;
+    }
+    words.back().text.append(bytes, length);
+    words.back().width += width;
+  });
+  return words;
+}
+
+// Fewest words per line, filling each line as far as it goes
+inline std::vector<std::size_t> GreedyBreaks(const std::vector<Word>& words, int line_width) {
+  std::vector<std::size_t> breaks;
+  int used = -1;
+  for (std::size_t i = 0; i < words.size(); ++i) {
+    if (i > 0 && used + 1 + words[i].width > line_width) {
+      breaks.push_back(i);
+      used = -1;
+    }
+    used += 1 + words[i].width;
+  }
+  return breaks;
+}
+
+// Minimum raggedness: the sum over all lines but the last of the squared
+// free space, minimized by dynamic programming from the last word back
+inline std::vector<std::size_t> OptimalBreaks(const std::vector<Word>& words, int line_width) {
+  const std::size_t n = words.size();
+  std::vector<int64_t> cost(n + 1, 0);
+  std::vector<std::size_t> next(n + 1, n);
+  for (std::size_t i = n; i-- > 0; ) {
+    cost[i] = std::numeric_limits<int64_t>::max();
+    int used = -1;
+    for (std::size_t j = i; j < n; ++j) {
+      used += 1 + words[j].width;
+      if (used > line_width && j > i) {
+        break;
+      }
+      const int64_t slack = line_width - used;
+      const int64_t line_cost = (j + 1 == n) ? 0 : slack * slack;
+      if (line_cost + cost[j + 1] < cost[i]) {
+        cost[i] = line_cost + cost[j + 1];
+        next[i] = j + 1;
       }
-      current += skip;
     }
   }
+  std::vector<std::size_t> breaks;
+  for (std::size_t i = next[0]; i < n; i = next[i]) {
+    breaks.push_back(i);
+  }
+  return breaks;
+}
 
-  void ParsePayload_24() {
-    uint8_t *current = reinterpret_cast<uint8_t*>(&(raw_.data()[data_->offset]));
-    int img_idx = 0;
-    const int skip = 4 - ((width_ * 3) % 4);
-    for (int i = 0; i < height_; ++i) {
-      for (int j = 0; j < width_; ++j) {
-        img_[img_idx++] = (static_cast<uint32_t>(*(current + 0)) +
-                           static_cast<uint32_t>(*(current + 1)) +
-                           static_cast<uint32_t>(*(current + 2))) / 3.0;
-        current += 3;
+inline std::vector<std::string> BreakLines(const std::string& text, int line_width, LineBreaking breaking) {
+  std::vector<std::string> lines;
+  std::size_t begin = 0;
+  while (begin <= text.size()) {
+    // Newlines always break
+    std::size_t end = text.find('\n', begin);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    const auto words = SplitWords(text.substr(begin, end - begin), line_width);
+    const auto breaks = (breaking == OptimalBreaking) ? OptimalBreaks(words, line_width)
+                                                      : GreedyBreaks(words, line_width);
+    std::size_t first = 0;
+    for (std::size_t k = 0; k <= breaks.size(); ++k) {
+      const std::size_t last = (k < breaks.size()) ? breaks[k] : words.size();
+      std::string line;
+      for (std::size_t i = first; i < last; ++i) {
+        line += (i > first) ? " " + words[i].text : words[i].text;
       }
-      current += skip;
+      lines.push_back(std::move(line));
+      first = last;
     }
+    begin = end + 1;
   }
+  return lines;
+}
 
-  void ParsePayload_32() {
-    uint8_t *current = reinterpret_cast<uint8_t*>(&(raw_.data()[data_->offset]));
-    int img_idx = 0;
-    for (int i = 0; i < height_; ++i) {
-      for (int j = 0; j < width_; ++j) {
-        img_[img_idx++] = (static_cast<uint32_t>(*(current + 0)) +
-                           static_cast<uint32_t>(*(current + 1)) +
-                           static_cast<uint32_t>(*(current + 2))) / 3.0;
-        current += 4;
+// Lines of recently broken texts, so that redrawing an unchanged text box
+// costs no line breaking. Shared by all plots and threads.
+class LineBreakCache {
+public:
+  using Lines = std::shared_ptr<const std::vector<std::string>>;
+
+  Lines Get(const std::string& text, int line_width, LineBreaking breaking) {
+    const std::size_t hash = std::hash<std::string>{}(text);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->hash == hash && it->line_width == line_width &&
+            it->breaking == breaking && it->text == text) {
+          std::rotate(entries_.begin(), it, it + 1);
+          return entries_.front().lines;
+        }
       }
     }
+
+    Lines lines = std::make_shared<const std::vector<std::string>>(
+      BreakLines(text, line_width, breaking));
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entries_.size() == kCapacity) {
+      entries_.pop_back();
+    }
+    entries_.insert(entries_.begin(), Entry{hash, text, line_width, breaking, lines});
+    return lines;
   }
+
+private:
+  static constexpr std::size_t kCapacity = 64;
+
+  struct Entry {
+    std::size_t hash;
+    std::string text;
+    int line_width;
+    LineBreaking breaking;
+    Lines lines;
+  };
+
+  std::mutex mutex_;
+  std::vector<Entry> entries_;
 };
 
-//********************************** IPlot **********************************//
+inline LineBreakCache& GetLineBreakCache() {
+  static LineBreakCache cache;
+  return cache;
+}
 
-class IPlot {
-public:
-  virtual Brush& At(int col, int row) = 0;
-  virtual const Brush& At(int col, int row) const = 0;
-  virtual std::string Serialize() const = 0;
-  virtual int GetWidth() const = 0;
-  virtual int GetHeight() const = 0;
-protected:
-  int width_;
-  int height_;
-  std::vector<Brush> canvas_;
+} // namespace detail
+
+//******************************** Big font *********************************//
+
+namespace detail {
+
+inline constexpr int kBigFontHeight = 5;
+
+// Glyphs are 3x5 cells, '#' for ink, laid side by side one space apart.
+// Columns without ink are trimmed, so '.' or '!' take a single column.
+struct BigFontStrip {
+  const char *chars;
+  const char *rows[kBigFontHeight];
+};
+
+inline constexpr BigFontStrip kBigFontStrips[] = {
+  {"0123456789 .,:-+%/()!?=_*#<>'$", {
+    "### .#. ### ### #.# ### ### ### ### ### ... ... ... ... ... ... #.# ..# .#. .#. .#. ### ... ... ... #.# ..# #.. .#. .##",
+    "#.# ##. ..# ..# #.# #.. #.. ..# #.# #.# ... ... ... .#. ... .#. ..# ..# #.. ..# .#. ..# ### ... #.# ### .#. .#. .#. ##.",
+    "#.# .#. ### ### ### ### ### ..# ### ### ... ... ... ... ### ### .#. .#. #.. ..# .#. .## ... ... .#. #.# #.. ..# ... .#.",
+    "#.# .#. #.. ..# ..# ..# #.# ..# #.# ..# ... ... .#. .#. ... .#. #.. #.. #.. ..# ... ... ### ... #.# ### .#. .#. ... .##",
+    "### ### ### ### ..# ### ### ..# ### ### ... .#. #.. ... ... ... #.# #.. .#. .#. .#. .#. ... ### ... #.# ..# #.. ... ##."
+  }},
+  {"ABCDEFGHIJKLM", {
+    ".#. ##. ### ##. ### ### ### #.# ### ..# #.# #.. #.#",
+    "#.# #.# #.. #.# #.. #.. #.. #.# .#. ..# #.# #.. ###",
+    "### ##. #.. #.# ##. ##. #.# ### .#. ..# ##. #.. ###",
+    "#.# #.# #.. #.# #.. #.. #.# #.# .#. #.# #.# #.. #.#",
+    "#.# ##. ### ##. ### #.. ### #.# ### ### #.# ### #.#"
+  }},
+  {"NOPQRSTUVWXYZ", {
+    "##. .#. ### ### ##. .## ### #.# #.# #.# #.# #.# ###",
+    "#.# #.# #.# #.# #.# #.. .#. #.# #.# #.# #.# #.# ..#",
+    "#.# #.# ### #.# ##. .#. .#. #.# #.# ### .#. .#. .#.",
+    "#.# #.# #.. ### #.# ..# .#. #.# #.# ### #.# .#. #..",
+    "#.# .#. #.. ..# #.# ##. .#. ### .#. #.# #.# .#. ###"
+  }},
+};
+
+// Horizontal run of ink in a glyph, rows counted from the top
+struct BigGlyphSpan {
+  uint8_t row, col, length;
+};
+
+struct BigGlyph {
+  uint8_t width = 0;
+  uint8_t span_count = 0;
+  BigGlyphSpan spans[2 * kBigFontHeight] = {};
+};
+
+// Printable ASCII, indexed by character - ' '
+struct BigFontAtlas {
+  BigGlyph glyphs[95] = {};
+
+  constexpr const BigGlyph& Get(char c) const {
+    if ('a' <= c && c <= 'z') {
+      c = c - 'a' + 'A';
+    }
+    const BigGlyph& glyph = glyphs[(' ' <= c && c <= '~') ? c - ' ' : '?' - ' '];
+    return glyph.width > 0 ? glyph : glyphs['?' - ' '];
+  }
 };
 
+// Turns the strips into spans at compile time
+inline constexpr BigFontAtlas BuildBigFont() {
+  BigFontAtlas atlas;
+  for (const auto& strip : kBigFontStrips) {
+    for (int k = 0; strip.chars[k] != '\0'; ++k) {
+      BigGlyph& glyph = atlas.glyphs[strip.chars[k] - ' '];
+      int first = 3, last = -1;
+      for (int r = 0; r < kBigFontHeight; ++r) {
+        for (int c = 0; c < 3; ++c) {
+          if (strip.rows[r][4 * k + c] == '#') {
+            first = first < c ? first : c;
+            last = last > c ? last : c;
+          }
+        }
+      }
+      if (last < 0) {
+        // The space
+        glyph.width = 2;
+        continue;
+      }
+      glyph.width = last - first + 1;
+      for (int r = 0; r < kBigFontHeight; ++r) {
+        for (int c = first; c <= last; ++c) {
+          if (strip.rows[r][4 * k + c] != '#') {
+            continue;
+          }
+          const bool extends = c > first && strip.rows[r][4 * k + c - 1] == '#';
+          if (extends) {
+            ++glyph.spans[glyph.span_count - 1].length;
+          } else {
+            glyph.spans[glyph.span_count++] = BigGlyphSpan{
+              static_cast<uint8_t>(r), static_cast<uint8_t>(c - first), 1
+            };
+          }
+        }
+      }
+    }
+  }
+  return atlas;
+}
+
+inline constexpr BigFontAtlas kBigFont = BuildBigFont();
+
+} // namespace detail
+
+// Columns taken by a string drawn with DrawBigText
+inline int BigTextWidth(const std::string& text) {
+  int width = 0;
+  for (char c : text) {
+    width += detail::kBigFont.Get(c).width + 1;
+  }
+  return std::max(0, width - 1);
+}
+
 //********************************** Plot ***********************************//
 
 // Forward declarations
@@ -938,11 +3699,15 @@ public:
     position.offset = Offset(new_col, new_row);
   }
 
+  // Counted as a write; reads inside the library use the const overload.
   virtual Brush& At(int col, int row) override {
+    ASKIPLOT_COUNT(at_calls, 1);
+    ASKIPLOT_COUNT(cells_written, 1);
     return canvas_[row + height_*col];
   }
 
   virtual const Brush& At(int col, int row) const override {
+    ASKIPLOT_COUNT(at_calls, 1);
     return canvas_[row + height_*col];
   }
 
@@ -1016,21 +3781,43 @@ public:
                      T gamma,
                      const Position& position,
                      int img_width,
-                     int img_height) {
+                     int img_height,
+                     Dithering dithering = NoDithering) {
     static_assert(std::is_base_of<__Gamma<T>, T>::value, "Template type T must be a subtype of __Gamma<T>.");
-
-    Image img_fit = img;
-    if (img.GetWidth() > img_width || img.GetHeight() > img_height) {
-      img_fit.Resize(img_width, img_height);
-    }
+    ASKIPLOT_TIME_API(ApiDrawImage, *this);
 
     const int len_w = std::min(img.GetWidth(), img_width);
     const int len_h = std::min(img.GetHeight(), img_height);
+    const auto resized = img.Resized(len_w, len_h);
+    const Image& img_fit = *resized;
     __Plot subplot(len_w, len_h);
 
+    const uint8_t *levels = &img_fit.At(0, 0);
+    std::vector<uint8_t> dithered;
+    if (dithering != NoDithering) {
+      const detail::LevelQuantizer quantizer(gamma.GetLevelStarts());
+      if (quantizer.GetRanges() > 1) {
+        dithered.assign(levels, levels + static_cast<std::size_t>(len_w) * len_h);
+        if (dithering == FloydSteinberg) {
+          detail::DitherFloydSteinberg(dithered.data(), len_w, len_h, quantizer);
+        } else {
+          detail::DitherOrdered(dithered.data(), len_w, len_h, quantizer);
+        }
+        levels = dithered.data();
+      }
+    }
+
+    const auto& glyphs = gamma.GetGlyphs();
+    std::vector<uint8_t> cells(len_w);
     for (int j = len_h - 1; j >= 0; --j) {
+      gamma.MapRow(levels + static_cast<std::size_t>(j) * len_w, len_w, cells.data());
       for (int i = 0; i < len_w; ++i) {
-        subplot.At(i, j) = gamma(img_fit.At(i, j));
+        subplot.At(i, j) = glyphs[cells[i]];
+      }
+      if (img_fit.HasColor()) {
+        for (int i = 0; i < len_w; ++i) {
+          subplot.At(i, j).SetColor(img_fit.GetColor(i, j));
+        }
       }
     }
 
@@ -1044,36 +3831,89 @@ public:
     return DrawImage(img, gamma, position, width_, height_);
   }
 
+  template<class T>
+  Subtype& DrawImage(const Image& img,
+                     T gamma,
+                     Dithering dithering,
+                     const Position& position = {0,0}) {
+    return DrawImage(img, gamma, position, width_, height_, dithering);
+  }
+
   Subtype& DrawLegend(const Position& position = NorthEast) {
+    ASKIPLOT_TIME_API(ApiDrawLegend, *this);
     if (metadata_.size() == 0) return static_cast<Subtype&>(*this);
 
-    int text_width =
-      std::max_element(metadata_.begin(), metadata_.end(),
-                       [](const auto& a, const auto& b)
-                       { return a.label.size() < b.label.size(); }
-      )->label.size();
-
-    const int box_width = text_width + 6;
-    const int box_height = metadata_.size() + 2;
-    
-    __Plot<Subtype> box(box_width, box_height);
+    Fuse(MakeLegendBox(), position, BlankFusion::KeepBlanks, AdjustPosition::Adjust);
+    return static_cast<Subtype&>(*this);
+  }
 
-    box.DrawBorders(Bottom)
-       .DrawBorders(Left + Right)
-       .DrawBorders(Top);
+  // Draws the legend where it covers the fewest non-blank cells, preferring
+  // the corners (NorthEast first) when several places are equally empty
+  Subtype& DrawLegendAuto() {
+    ASKIPLOT_TIME_API(ApiDrawLegendAuto, *this);
+    if (metadata_.size() == 0) return static_cast<Subtype&>(*this);
 
-    // Writing labels
-    for (std::size_t i = 0; i < metadata_.size(); ++i) {
-      box.DrawText(metadata_[i].brush.GetValue() + " " + metadata_[i].label,
-                   Position(2, box_height - 2 - i)
-      );
+    const auto box = MakeLegendBox();
+    if (box.GetWidth() > width_ || box.GetHeight() > height_) {
+      return DrawLegend(NorthEast);
     }
-    Fuse(box, position, BlankFusion::KeepBlanks, AdjustPosition::Adjust);
-
+    Fuse(box, FindEmptiestRegion(box.GetWidth(), box.GetHeight()),
+         BlankFusion::KeepBlanks, AdjustPosition::DontAdjust);
     return static_cast<Subtype&>(*this);
   }
 
+  // Lower left corner of the box_width x box_height region holding the
+  // fewest non-blank cells. A summed-area table of the canvas is built once,
+  // then each candidate region is counted in constant time.
+  Position FindEmptiestRegion(int box_width, int box_height) const {
+    box_width = std::max(1, std::min(box_width, width_));
+    box_height = std::max(1, std::min(box_height, height_));
+
+    // Filled column by column, the canvas being column-major
+    const int stride = width_ + 1;
+    std::vector<uint32_t> table(static_cast<std::size_t>(stride) * (height_ + 1), 0);
+    for (int i = 0; i < width_; ++i) {
+      uint32_t column_sum = 0;
+      for (int j = 0; j < height_; ++j) {
+        column_sum += !At(i, j).IsBlank();
+        table[(j + 1) * stride + i + 1] = table[(j + 1) * stride + i] + column_sum;
+      }
+    }
+    auto count = [&](int col, int row) {
+      const int c1 = col + box_width, r1 = row + box_height;
+      return table[r1 * stride + c1] - table[row * stride + c1]
+           - table[r1 * stride + col] + table[row * stride + col];
+    };
+
+    const int max_col = width_ - box_width;
+    const int max_row = height_ - box_height;
+    const Offset corners[] = {
+      {max_col, max_row}, {0, max_row}, {max_col, 0}, {0, 0}
+    };
+    Offset best = corners[0];
+    uint32_t best_count = count(best.GetCol(), best.GetRow());
+    for (const auto& corner : corners) {
+      const uint32_t c = count(corner.GetCol(), corner.GetRow());
+      if (c < best_count) {
+        best = corner;
+        best_count = c;
+      }
+    }
+    // Anywhere else only wins when strictly emptier, top rows first
+    for (int row = max_row; row >= 0 && best_count > 0; --row) {
+      for (int col = max_col; col >= 0; --col) {
+        const uint32_t c = count(col, row);
+        if (c < best_count) {
+          best = Offset(col, row);
+          best_count = c;
+        }
+      }
+    }
+    return Position(best);
+  }
+
   Subtype& DrawLine(double x_begin, double y_begin, double x_end, double y_end) {
+    ASKIPLOT_TIME_API(ApiDrawLine, *this);
     auto brush = palette_.GetBrush("Main");
 
     const double xstep = (xlim_right_ - xlim_left_) / width_;
@@ -1190,6 +4030,7 @@ public:
   Subtype& DrawPoints(const std::vector<Tx>& x,
                       const std::vector<Ty>& y,
                       std::size_t how_many) {
+    ASKIPLOT_TIME_API(ApiDrawPoints, *this);
     SetAutoLimits(x, y);
     
     const double xstep = (xlim_right_ - xlim_left_) / width_;
@@ -1217,21 +4058,41 @@ public:
   Subtype& DrawText(const std::string& text,
                     const Position& position,
                     AdjustPosition adjust = Adjust) {
+    ASKIPLOT_TIME_API(ApiDrawText, *this);
     auto pos_abs = GetAbsolutePosition(position);
 
     if (adjust) {
-      AdjustAbsolutePosition(pos_abs, text.size(), 1, false);
+      AdjustAbsolutePosition(pos_abs, DisplayWidth(text), 1, false);
     }
 
     const int col = pos_abs.offset.GetCol();
     const int row = pos_abs.offset.GetRow();
 
     if (0 <= row && row < height_) {
-      const int n = std::min<int>(width_ - col, text.size());
-      const int cut_out = -std::min(0, col);
-      for (int i = cut_out; i < n; ++i) {
-        At(i + col, row) = Brush("*", text[i]);
-      }
+      int x = col;
+      Brush *last = nullptr;
+      detail::ForEachCharacter(text, [&](const char *bytes, std::size_t length, int width) {
+        if (width == 0) {
+          if (last != nullptr) {
+            last->Append(bytes, length);
+          }
+          return;
+        }
+        last = nullptr;
+        if (x + width > 0 && x < width_) {
+          if (x >= 0 && x + width <= width_) {
+            last = &At(x, row);
+            last->SetText(bytes, length);
+            if (width == 2) {
+              At(x + 1, row).SetText("", 0);
+            }
+          } else {
+            // Wide character cut by a border: blank its visible half
+            At(std::max(x, 0), row).SetText(" ", 1);
+          }
+        }
+        x += width;
+      });
     }
     return static_cast<Subtype&>(*this);
   }
@@ -1239,7 +4100,7 @@ public:
   Subtype& DrawTextCentered(const std::string& text,
                             const Position& position,
                             AdjustPosition adjust = Adjust) {
-    return DrawText(text, position - Offset(text.size() / 2, 0), adjust);
+    return DrawText(text, position - Offset(DisplayWidth(text) / 2, 0), adjust);
   }
 
   Subtype& DrawTextVertical(const std::string& text,
@@ -1248,26 +4109,200 @@ public:
     auto pos_abs = GetAbsolutePosition(position);
 
     if (adjust) {
-      AdjustAbsolutePosition(pos_abs, 1, text.size(), false);
+      AdjustAbsolutePosition(pos_abs, 1, detail::VerticalLength(text), false);
     }
 
     const int col = pos_abs.offset.GetCol();
     const int row = pos_abs.offset.GetRow();
 
     if (0 <= col && col < width_) {
-      const int n = std::min<int>(row + 1, text.size());
-      const int cut_out = std::max(row - height_ + 1, 0);
-      for (int j = cut_out; j < n; ++j) {
-        At(col, row - j) = Brush("*", text[j]);
-      }
-    } 
+      // One character per row, wide ones spilling into the next column
+      int y = row;
+      Brush *last = nullptr;
+      detail::ForEachCharacter(text, [&](const char *bytes, std::size_t length, int width) {
+        if (width == 0) {
+          if (last != nullptr) {
+            last->Append(bytes, length);
+          }
+          return;
+        }
+        last = nullptr;
+        if (0 <= y && y < height_) {
+          if (width == 2 && col + 1 == width_) {
+            At(col, y).SetText(" ", 1);
+          } else {
+            last = &At(col, y);
+            last->SetText(bytes, length);
+            if (width == 2) {
+              At(col + 1, y).SetText("", 0);
+            }
+          }
+        }
+        --y;
+      });
+    }
     return static_cast<Subtype&>(*this);
   }
 
   Subtype& DrawTextVerticalCentered(const std::string& text,
                                     const Position& position,
                                     AdjustPosition adjust = Adjust) {
-    return DrawTextVertical(text, position + Offset(0, text.size() / 2), adjust);
+    return DrawTextVertical(text, position + Offset(0, detail::VerticalLength(text) / 2), adjust);
+  }
+
+  // Places a batch of labels without overlaps. Each label is tried centered
+  // on its anchor, then one row above or below, then beside the anchor and
+  // finally two rows away. A label fitting none of these is either dropped
+  // or cut to the widest free run among them.
+  Subtype& DrawLabels(const std::vector<Label>& labels,
+                      LabelOverflow overflow = DropLabels,
+                      LabelCollisions collisions = AvoidContent) {
+    ASKIPLOT_TIME_API(ApiDrawLabels, *this);
+    detail::OccupancyGrid grid(width_, height_);
+    if (collisions == AvoidContent) {
+      for (int i = 0; i < width_; ++i) {
+        for (int j = 0; j < height_; ++j) {
+          if (!std::as_const(*this).At(i, j).IsBlank()) {
+            grid.Mark(i, j);
+          }
+        }
+      }
+    }
+
+    std::vector<std::size_t> order(labels.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&labels](std::size_t a, std::size_t b) {
+      return labels[a].GetPriority() > labels[b].GetPriority();
+    });
+
+    for (std::size_t index : order) {
+      const Label& label = labels[index];
+      const int width = DisplayWidth(label.GetText());
+      if (width == 0) {
+        continue;
+      }
+      const Offset anchor = GetAbsolutePosition(label.GetAnchor()).offset;
+      const int centered = anchor.GetCol() - width / 2;
+      const Offset candidates[] = {
+        {centered, anchor.GetRow()},
+        {centered, anchor.GetRow() + 1},
+        {centered, anchor.GetRow() - 1},
+        {anchor.GetCol() + 1, anchor.GetRow()},
+        {anchor.GetCol() - width, anchor.GetRow()},
+        {centered, anchor.GetRow() + 2},
+        {centered, anchor.GetRow() - 2}
+      };
+
+      const Offset *chosen = nullptr;
+      int run = width;
+      for (const auto& candidate : candidates) {
+        if (grid.IsFree(candidate.GetCol(), candidate.GetCol() + width, candidate.GetRow())) {
+          chosen = &candidate;
+          break;
+        }
+      }
+      if (chosen == nullptr && overflow == ShortenLabels) {
+        run = 0;
+        for (const auto& candidate : candidates) {
+          const int free = grid.FreeRun(candidate.GetCol(), candidate.GetCol() + width, candidate.GetRow());
+          if (free > run) {
+            run = free;
+            chosen = &candidate;
+          }
+        }
+        // Too short to be useful once the marker is in
+        if (run < 2) {
+          chosen = nullptr;
+        }
+      }
+      if (chosen == nullptr) {
+        continue;
+      }
+
+      const std::string text = (run < width)
+        ? detail::TruncateToWidth(label.GetText(), run - 1) + "~"
+        : label.GetText();
+      const int text_width = std::min(run, width);
+      DrawText(text, Position(*chosen), DontAdjust);
+      grid.Mark(chosen->GetCol(), chosen->GetCol() + text_width, chosen->GetRow());
+    }
+    return static_cast<Subtype&>(*this);
+  }
+
+  // Writes text wrapped at word boundaries inside the box with the given
+  // corners. Lines that do not fit are dropped, the last one shown ending
+  // with '~'. Breaks are cached per text and box width.
+  Subtype& DrawTextBox(const std::string& text,
+                       const Position& corner1,
+                       const Position& corner2,
+                       Alignment alignment = AlignLeft,
+                       LineBreaking breaking = GreedyBreaking) {
+    const auto pos_abs1 = GetAbsolutePosition(corner1).offset;
+    const auto pos_abs2 = GetAbsolutePosition(corner2).offset;
+    const int left = std::min(pos_abs1.GetCol(), pos_abs2.GetCol());
+    const int top = std::max(pos_abs1.GetRow(), pos_abs2.GetRow());
+    const int box_width = std::abs(pos_abs2.GetCol() - pos_abs1.GetCol()) + 1;
+    const int box_height = std::abs(pos_abs2.GetRow() - pos_abs1.GetRow()) + 1;
+
+    const auto lines = detail::GetLineBreakCache().Get(text, box_width, breaking);
+    const int shown = std::min<int>(box_height, lines->size());
+    for (int k = 0; k < shown; ++k) {
+      const bool cut = (k + 1 == shown && shown < static_cast<int>(lines->size()));
+      const std::string line = cut
+        ? detail::TruncateToWidth((*lines)[k], box_width - 1) + "~"
+        : (*lines)[k];
+      const int free = box_width - DisplayWidth(line);
+      const int indent = (alignment == AlignCenter) ? free / 2
+                       : (alignment == AlignRight) ? free : 0;
+      DrawText(line, Position(left + indent, top - k), DontAdjust);
+    }
+    return static_cast<Subtype&>(*this);
+  }
+
+  // Writes text in a 5-row block font, position being its upper left
+  // corner. Letters are drawn uppercase and characters outside the font,
+  // such as non-ASCII bytes, as '?'.
+  Subtype& DrawBigText(const std::string& text,
+                       const Position& position,
+                       const Brush& brush,
+                       AdjustPosition adjust = Adjust) {
+    auto pos_abs = GetAbsolutePosition(position);
+
+    if (adjust) {
+      AdjustAbsolutePosition(pos_abs, BigTextWidth(text), detail::kBigFontHeight, false);
+    }
+
+    int col = pos_abs.offset.GetCol();
+    const int top = pos_abs.offset.GetRow();
+    for (char c : text) {
+      const detail::BigGlyph& glyph = detail::kBigFont.Get(c);
+      for (int k = 0; k < glyph.span_count; ++k) {
+        const detail::BigGlyphSpan& span = glyph.spans[k];
+        const int row = top - span.row;
+        if (row < 0 || row >= height_) {
+          continue;
+        }
+        const int begin = std::max(0, col + span.col);
+        const int end = std::min(width_, col + span.col + span.length);
+        for (int i = begin; i < end; ++i) {
+          At(i, row) = brush;
+        }
+      }
+      col += glyph.width + 1;
+    }
+    return static_cast<Subtype&>(*this);
+  }
+
+  Subtype& DrawBigText(const std::string& text,
+                       const Position& position,
+                       AdjustPosition adjust = Adjust) {
+    return DrawBigText(text, position, palette_.GetBrush("Area"), adjust);
+  }
+
+  Subtype& DrawBigTextCentered(const std::string& text,
+                               const Position& position,
+                               AdjustPosition adjust = Adjust) {
+    return DrawBigText(text, position - Offset(BigTextWidth(text) / 2, 0), adjust);
   }
 
   Subtype& DrawTitle() {
@@ -1297,6 +4332,7 @@ public:
   }
 
   Subtype& Fill(const Brush& brush) {
+    ASKIPLOT_TIME_API(ApiFill, *this);
     for (int i = 0; i < width_; ++i) {
       for (int j = 0; j < height_; ++j) {
         At(i, j) = brush;
@@ -1314,6 +4350,7 @@ public:
                 const Position& position = SouthWest,
                 BlankFusion keep_blanks = KeepBlanks,
                 AdjustPosition adjust = Adjust) {
+    ASKIPLOT_TIME_API(ApiFuse, *this);
     auto pos_abs = GetAbsolutePosition(position);
     if (adjust) {
       AdjustAbsolutePosition(pos_abs, other.GetWidth(), other.GetHeight(), true);
@@ -1352,7 +4389,7 @@ public:
   Subtype& Move(const Offset& offset) {
     auto copy = *this;
     Clear();
-    Fuse(copy, offset, DontAdjust);
+    Fuse(copy, offset, KeepBlanks, DontAdjust);
     return static_cast<Subtype&>(*this);
   }
 
@@ -1360,6 +4397,20 @@ public:
     return palette_;
   }
 
+#if defined(ASKIPLOT_INSTRUMENTATION)
+  // Work done by the instrumented methods of this plot. Serialize() const
+  // updates these counters too, so a plot serialized from several threads
+  // at once needs external locking while instrumented.
+  const RenderStats& GetStats() const {
+    return stats_;
+  }
+
+  Subtype& ResetStats() {
+    stats_ = RenderStats{};
+    return static_cast<Subtype&>(*this);
+  }
+#endif
+
   const Palette& NewBrushes() const {
     return palette_;
   }
@@ -1369,6 +4420,7 @@ public:
                     const std::vector<Ty>& y,
                     const std::string& label,
                     std::size_t how_many) {
+    ASKIPLOT_TIME_API(ApiPlotData, *this);
     DrawPoints(x, y, how_many);
     metadata_.push_back(
       PlotMetadata{}.SetLabel(label)
@@ -1398,14 +4450,39 @@ public:
   }
 
   virtual std::string Serialize() const override {
-    std::stringstream ss("");
+    ASKIPLOT_TIME_API(ApiSerialize, *this);
+    std::string out;
+    out.reserve(static_cast<std::size_t>(width_ + 1) * height_);
+    if (color_mode_ == NoColor) {
+      for (int j = height_ - 1; j >= 0; --j) {
+        for (int i = 0; i < width_; ++i) {
+          out += At(i, j).GetValue();
+        }
+        out += '\n';
+      }
+      ASKIPLOT_COUNT(bytes_serialized, out.size());
+      return out;
+    }
+
+    // Escape sequences are only emitted where the rendered color changes,
+    // and spaces, whose foreground is invisible, never change it.
+    Color current;
     for (int j = height_ - 1; j >= 0; --j) {
       for (int i = 0; i < width_; ++i) {
-        ss << At(i, j).GetValue();
+        const Brush& brush = At(i, j);
+        if (!brush.GetColor().LooksLike(current, color_mode_) && brush.GetValue() != " ") {
+          current = brush.GetColor();
+          current.AppendEscape(out, color_mode_);
+        }
+        out += brush.GetValue();
       }
-      ss << "\n";
+      out += '\n';
     }
-    return ss.str();
+    if (current.IsSet()) {
+      Color().AppendEscape(out, color_mode_);
+    }
+    ASKIPLOT_COUNT(bytes_serialized, out.size());
+    return out;
   }
 
   template<class Tx, class Ty>
@@ -1482,6 +4559,7 @@ public:
     }
   }
 
+  ColorMode GetColorMode() const { return color_mode_; }
   std::string GetName() const { return name_; }
   std::string GetTitle() const { return title_; }
   int GetWidth() const override { return width_; }
@@ -1501,7 +4579,18 @@ public:
   }
   
   Subtype& SetBrush(const Brush& brush) {
-    return SetBrush(brush.GetName(), brush.GetValue());
+    palette_(brush);
+    return static_cast<Subtype&>(*this);
+  }
+
+  Subtype& SetBrushColor(const std::string& name, const Color& color) {
+    palette_.SetColor(name, color);
+    return static_cast<Subtype&>(*this);
+  }
+
+  Subtype& SetColorMode(ColorMode mode) {
+    color_mode_ = mode;
+    return static_cast<Subtype&>(*this);
   }
 
   Subtype& SetMainBrush(const std::string& value) {
@@ -1575,6 +4664,30 @@ public:
   }
 
 protected:
+  __Plot<Subtype> MakeLegendBox() const {
+    int text_width = 0;
+    for (const auto& entry : metadata_) {
+      text_width = std::max(text_width, DisplayWidth(entry.label));
+    }
+
+    const int box_width = text_width + 6;
+    const int box_height = metadata_.size() + 2;
+    
+    __Plot<Subtype> box(box_width, box_height);
+
+    box.DrawBorders(Bottom)
+       .DrawBorders(Left + Right)
+       .DrawBorders(Top);
+
+    // Writing labels
+    for (std::size_t i = 0; i < metadata_.size(); ++i) {
+      box.DrawText(metadata_[i].brush.GetValue() + " " + metadata_[i].label,
+                   Position(2, box_height - 2 - i)
+      );
+    }
+    return box;
+  }
+
   Position CalcBoxPosition(const Position& position, int box_width, int box_height) {
     switch (position.relative) {
     case North:
@@ -1602,7 +4715,11 @@ protected:
   std::string name_;
   std::string title_;
   Palette palette_;
+  ColorMode color_mode_ = NoColor;
   Borders autolimit_;
+#if defined(ASKIPLOT_INSTRUMENTATION)
+  mutable RenderStats stats_;
+#endif
   double xlim_margin_;
   double xlim_left_;
   double xlim_right_;
@@ -1716,17 +4833,22 @@ public:
     return static_cast<Subtype&>(*this);
   }  
 
-  Subtype& DrawBarLabels(const Offset& text_offset = {0, 0}) {
+  // Names are placed by DrawLabels, so they neither overlap each other
+  // nor cover the bars
+  Subtype& DrawBarLabels(const Offset& text_offset = {0, 0},
+                         LabelOverflow overflow = ShortenLabels) {
+    std::vector<Label> labels;
+    labels.reserve(bars_.size());
     for (const auto& bar : bars_) {
-      this->DrawTextCentered(bar.GetName(),
-                             Offset(bar.GetColumn() + bar.GetWidth() / 2,
-                                    bar.GetHeight()) + text_offset,
-                             DontAdjust);
+      labels.emplace_back(bar.GetName(),
+                          Offset(bar.GetColumn() + bar.GetWidth() / 2,
+                                 bar.GetHeight()) + text_offset);
     }
-    return static_cast<Subtype&>(*this);
+    return this->DrawLabels(labels, overflow);
   }
 
   Subtype& PlotBars(const std::vector<Bar>& bars) {
+    ASKIPLOT_TIME_API(ApiPlotBars, *this);
     bars_.clear();
     std::copy_if(bars.begin(), bars.end(), std::back_inserter(bars_),
                  [](const auto& b) { return !b.IsEmpty(); });
@@ -1748,7 +4870,8 @@ public:
     
     std::vector<Ty> ydata_filled(nbars);
     for (std::size_t i = 0; i < xdata.size(); i++) {
-      const double normalized_x = (double)(xdata[i] - min_x) / (double)span_x;
+      const double normalized_x =
+          span_x > 0 ? (double)(xdata[i] - min_x) / (double)span_x : 0.0;
       const int remapped_x = normalized_x * (nbars - 1);
       ydata_filled[remapped_x] = ydata[i];
     }
@@ -1808,7 +4931,7 @@ public:
     bars.reserve(nbars);
     for (std::size_t i = 0; i < nbars; ++i) {
       bars.push_back(
-        Bar{}.SetName(FormatValue(ydata[i]))
+        Bar{}.SetName(detail::FormatValue(ydata[i]))
              .SetHeight((ydata[i] - ylim_bottom) / ystep)
              .SetColumn(i * bar_width)
              .SetWidth(bar_width)
@@ -1893,6 +5016,7 @@ public:
   }
 
   BarPlot& Commit(double height_resize = 0.8) {
+    ASKIPLOT_TIME_API(ApiCommit, baseplot_);
     if (metadata_.size() == 0) {
       return baseplot_;
     }
@@ -1928,9 +5052,9 @@ public:
       for (int j = 0; j < group_size_; ++j) {
         std::string name;
         if (metadata_[j].is_integer) {
-          name = FormatValue(static_cast<long int>(metadata_[j].ydata[i]));
+          name = detail::FormatValue(static_cast<long int>(metadata_[j].ydata[i]));
         } else {
-          name = FormatValue(metadata_[j].ydata[i]);
+          name = detail::FormatValue(metadata_[j].ydata[i]);
         }
         int height;
         if (metadata_[j].scaling == NotScaled) {
@@ -2033,9 +5157,14 @@ public:
                          double height_resize = 0.8) {
     static_assert(std::is_arithmetic<T>::value,
       "PlotHistogram only supports vectors of arithmetic types.");
+    ASKIPLOT_TIME_API(ApiPlotHistogram, *this);
 
-    const int distinct = std::set<T>(data.begin(), data.end()).size();
-    nbins_ = std::min(nbins_, distinct);
+    // Only fewer distinct values than bins matter
+    std::set<T> distinct;
+    for (auto it = data.begin(); it != data.end() && (int)distinct.size() < nbins_; ++it) {
+      distinct.insert(*it);
+    }
+    nbins_ = std::min<int>(nbins_, distinct.size());
 
     auto minmax = std::minmax_element(data.begin(), data.end());
     const T min = *minmax.first;
@@ -2063,7 +5192,7 @@ public:
     bars.resize(nbins_);
     for (int i = 0; i < nbins_; ++i) {
       bars.push_back(
-        Bar{}.SetName(FormatValue(bar_heights_[i]))
+        Bar{}.SetName(detail::FormatValue(bar_heights_[i]))
              .SetHeight(bar_heights_[i])
              .SetBrush(brush)
              .SetColumn(i * bin_width)
@@ -2137,6 +5266,7 @@ public:
   }
 
   virtual Brush& At(int col, int row) override {
+    ASKIPLOT_COUNT(cells_written, 1);
     return const_cast<Brush&>(
       static_cast<const Subtype*>(this)->At(col, row)
     );
@@ -2273,6 +5403,77 @@ private:
   int nplots_;
 };
 
+//***************************** SequencePlayer ******************************//
+
+// Renders the frames of an ImageSequence at a steady pace. Frames that are
+// already late by a whole period when they become available are dropped
+// instead of drawn, so slow terminals skip ahead rather than lag behind.
+class SequencePlayer {
+public:
+  SequencePlayer(ImageSequence& sequence)
+      : sequence_(sequence) {}
+
+  // Frames per second, 0 uses the rate of the sequence if known and
+  // otherwise plays as fast as possible
+  SequencePlayer& SetFrameRate(double fps) {
+    frame_rate_ = std::max(0.0, fps);
+    return *this;
+  }
+
+  SequencePlayer& SetDithering(Dithering dithering) {
+    dithering_ = dithering;
+    return *this;
+  }
+
+  int GetShownFrames() const { return shown_; }
+  int GetDroppedFrames() const { return dropped_; }
+
+  // Plays the whole sequence, writing each rendered plot to `out`.
+  // Returns the number of frames shown.
+  template<class Subtype, class T = FixedGamma>
+  int Play(__Plot<Subtype>& plot, std::ostream& out, T gamma = {}) {
+    using Clock = std::chrono::steady_clock;
+    // The rate of the sequence is known once its first frame is decoded
+    auto frame = sequence_.Next();
+    const double fps = (frame_rate_ > 0.0) ? frame_rate_ : sequence_.GetFrameRate();
+    const auto period = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(fps > 0.0 ? 1.0 / fps : 0.0));
+    const auto start = Clock::now();
+
+    for (int64_t i = 0; frame; frame = sequence_.Next(), ++i) {
+      if (fps > 0.0) {
+        const auto deadline = start + period * i;
+        if (Clock::now() > deadline + period) {
+          ++dropped_;
+          continue;
+        }
+        std::this_thread::sleep_until(deadline);
+      }
+
+      // Frames of a stream usually share their size: plan once
+      if (!plan_ || !plan_->Matches(frame->GetWidth(), frame->GetHeight(),
+                                    plot.GetWidth(), plot.GetHeight())) {
+        plan_ = std::make_unique<ResizePlan>(frame->GetWidth(), frame->GetHeight(),
+                                             plot.GetWidth(), plot.GetHeight());
+      }
+      frame->Resize(*plan_);
+      plot.DrawImage(*frame, gamma, dithering_);
+      out << plot.Serialize();
+      out.flush();
+      ++shown_;
+    }
+    return shown_;
+  }
+
+private:
+  ImageSequence& sequence_;
+  double frame_rate_ = 0.0;
+  Dithering dithering_ = NoDithering;
+  std::unique_ptr<ResizePlan> plan_;
+  int shown_ = 0;
+  int dropped_ = 0;
+};
+
 //***************************** Free functions ******************************//
 
 template<class T>
@@ -2282,7 +5483,7 @@ T BlankLike(const T& plot) {
   return T(plot.GetWidth(), plot.GetHeight());
 }
 
-std::vector<Brush> StringToBrushes(const std::string& str) {
+inline std::vector<Brush> StringToBrushes(const std::string& str) {
   std::vector<Brush> brushes;
   for (auto c : str) {
     brushes.push_back(Brush("*", c));
@@ -2290,10 +5491,79 @@ std::vector<Brush> StringToBrushes(const std::string& str) {
   return brushes;
 }
 
-std::vector<Brush> StringToBrushes(const char *str) {
+inline std::vector<Brush> StringToBrushes(const char *str) {
   return StringToBrushes(std::string(str));
 }
 
+// Number of terminal columns taken by a UTF-8 string
+inline int DisplayWidth(const std::string& text) {
+  int width = 0;
+  detail::ForEachCharacter(text, [&width](const char *, std::size_t, int char_width) {
+    width += char_width;
+  });
+  return width;
+}
+
+//************************* Explicit instantiations *************************//
+
+// With ASKIPLOT_EXTERN_TEMPLATES defined, the plot classes are compiled once
+// in libaskiplot (src/askiplot.cpp) instead of in every translation unit.
+// Member templates, such as PlotData<T>, are still instantiated where used.
+
+#if defined(ASKIPLOT_EXTERN_TEMPLATES)
+extern template class __Plot<Plot>;
+extern template class __Plot<BarPlot>;
+extern template class __BarPlot<BarPlot>;
+extern template class __Plot<HistPlot>;
+extern template class __BarPlot<HistPlot>;
+extern template class __HistPlot<HistPlot>;
+extern template class __Plot<GridPlot>;
+extern template class __GridPlot<GridPlot>;
+#endif
+
+} // namespace ASKIPLOT_ABI_NAMESPACE
 } // namespace askiplot
 
+#if defined(ASKIPLOT_INSTRUMENTATION) && defined(ASKIPLOT_INSTRUMENT_NEW)
+
+// Replacements of the global allocation functions counting allocations,
+// to be defined in a single translation unit. Kept out of line, or GCC
+// takes the inlined free() for a mismatch with new.
+
+#if defined(__GNUC__)
+#define ASKIPLOT_NOINLINE __attribute__((noinline))
+#else
+#define ASKIPLOT_NOINLINE
+#endif
+
+ASKIPLOT_NOINLINE void* operator new(std::size_t size) {
+  ASKIPLOT_COUNT(allocations, 1);
+  if (void *p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+ASKIPLOT_NOINLINE void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+ASKIPLOT_NOINLINE void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+ASKIPLOT_NOINLINE void operator delete[](void *p) noexcept {
+  std::free(p);
+}
+
+ASKIPLOT_NOINLINE void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
+
+ASKIPLOT_NOINLINE void operator delete[](void *p, std::size_t) noexcept {
+  std::free(p);
+}
+
+#endif // ASKIPLOT_INSTRUMENT_NEW
+
 #endif // ASKIPLOT_HPP_
@@ -0,0 +1,32 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Explicit instantiations of the plot classes declared extern in
+// askiplot.hpp under ASKIPLOT_EXTERN_TEMPLATES
+
+#include <askiplot.hpp>
+
+namespace askiplot {
+
+template class __Plot<Plot>;
+template class __Plot<BarPlot>;
+template class __BarPlot<BarPlot>;
+template class __Plot<HistPlot>;
+template class __BarPlot<HistPlot>;
+template class __HistPlot<HistPlot>;
+template class __Plot<GridPlot>;
+template class __GridPlot<GridPlot>;
+
+} // namespace askiplot
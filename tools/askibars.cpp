@@ -21,6 +21,35 @@
 // - The parsed data is stored in two vectors: `x` (first column) and `y`
 // (second column).
 //
+// Binary input:
+// - `--format=f32|f64|i64` reads raw little-endian values instead of text,
+// in rows of `--columns=N` values (default 1).
+// - Files in the columnar format of ingest.hpp, as written by
+// ingest::write_columnar, are recognized by their header and need no flag.
+// Both are used in place, without parsing.
+//
+// Bucketing:
+// - With more rows than the plot has columns, bars would overlap. Passing
+// `--agg=mean|max|min|sum|p99` splits the range of `x` into one bucket per
+// column and plots that aggregate of the `y` values falling in each bucket.
+// Pipes are read once, in blocks, so memory then stays proportional to the
+// plot width rather than to the input. Regular files are mapped and read
+// twice, first to find the range of `x`, for exact bucket edges.
+// - p99 is estimated from a uniform sample of each bucket when it holds more
+// than 1024 values.
+//
+// Follow mode:
+// - `--follow` keeps reading stdin, or the file if given, as it grows, like
+// `tail -f`, and redraws the chart in place with the last values.
+// - `--window=N` sets how many values are kept (default 50).
+// - `--fps=N` caps the redraw rate (default 10). Nothing is redrawn until new
+// data arrives.
+// - Invalid lines are skipped instead of stopping the program.
+// - With a pipe, the program exits when the writer closes it.
+//
+// $ tail -f app.log | grep --line-buffered latency | cut -d' ' -f3 |
+//       askibars.out --follow --window=80
+//
 // clang-format off
 // $ cat a.txt
 // 1
@@ -70,97 +99,333 @@
 // |###||###||###||###||###||###||###||###||###||###||###||###||###||###||###||###||###||###||###|
 // clang-format on
 
-#include <cctype>
-#include <fstream>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <iostream>
-#include <sstream>
 #include <string>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
 #include "askiplot.hpp"
+#include "ingest.hpp"
 
 using namespace std;
 
-void trim(string &s) {
-  size_t start = s.find_first_not_of(" \t\r\n");
-  size_t end = s.find_last_not_of(" \t\r\n");
-  if (start == string::npos) {
-    s.clear();
-  } else {
-    s = s.substr(start, end - start + 1);
+namespace {
+
+struct Options {
+  string path;
+  bool follow = false;
+  size_t window = 50;
+  int fps = 10;
+  bool aggregate = false;
+  ingest::Aggregate agg = ingest::kMean;
+  bool binary = false;
+  ingest::ValueType type = ingest::kFloat64;
+  size_t columns = 1;
+};
+
+// Keeps the last `capacity` values pushed, oldest first
+template <class T>
+class RingBuffer {
+public:
+  explicit RingBuffer(size_t capacity) : data_(capacity) {}
+
+  void push(const T &value) {
+    data_[(start_ + size_) % data_.size()] = value;
+    if (size_ < data_.size()) {
+      ++size_;
+    } else {
+      start_ = (start_ + 1) % data_.size();
+    }
   }
+
+  size_t size() const { return size_; }
+
+  const T &operator[](size_t i) const {
+    return data_[(start_ + i) % data_.size()];
+  }
+
+private:
+  vector<T> data_;
+  size_t start_ = 0;
+  size_t size_ = 0;
+};
+
+bool parse_count(const string &arg, const string &prefix, long &value) {
+  if (arg.compare(0, prefix.size(), prefix) != 0) {
+    return false;
+  }
+  char *end = nullptr;
+  value = strtol(arg.c_str() + prefix.size(), &end, 10);
+  if (end == arg.c_str() + prefix.size() || *end != '\0' || value <= 0) {
+    value = -1;
+  }
+  return true;
 }
 
-void split(const string &line, vector<string> &tokens) {
-  tokens.clear();
-  string token;
-  for (size_t i = 0; i < line.size(); ++i) {
-    char c = line[i];
-    if (c == ',' || c == '\t' || isspace(static_cast<unsigned char>(c))) {
-      if (!token.empty()) {
-        tokens.push_back(token);
-        token.clear();
+bool parse_options(int argc, char *argv[], Options &options) {
+  for (int i = 1; i < argc; ++i) {
+    const string arg = argv[i];
+    long value = 0;
+    if (arg == "--follow") {
+      options.follow = true;
+    } else if (parse_count(arg, "--window=", value)) {
+      if (value < 0) {
+        return false;
+      }
+      options.window = value;
+    } else if (parse_count(arg, "--fps=", value)) {
+      if (value < 0 || value > 1000) {
+        return false;
       }
+      options.fps = value;
+    } else if (parse_count(arg, "--columns=", value)) {
+      if (value < 0) {
+        return false;
+      }
+      options.columns = value;
+    } else if (arg.compare(0, 9, "--format=") == 0) {
+      options.binary = arg != "--format=text";
+      if (options.binary && !ingest::parse_value_type(arg.substr(9), options.type)) {
+        return false;
+      }
+    } else if (arg.compare(0, 6, "--agg=") == 0) {
+      if (!ingest::parse_aggregate(arg.substr(6), options.agg)) {
+        return false;
+      }
+      options.aggregate = true;
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      return false;
+    } else if (options.path.empty()) {
+      options.path = arg;
     } else {
-      token += c;
+      return false;
     }
   }
-  if (!token.empty())
-    tokens.push_back(token);
+  // Binary input has no end to wait for
+  return !(options.follow && options.binary);
 }
 
-int main(int argc, char *argv[]) {
-  istream *in = &cin;
-  ifstream file;
-  if (argc > 1) {
-    file.open(argv[1]);
-    if (!file) {
-      cerr << "Error: Cannot open file " << argv[1] << endl;
+string draw_bars(askiplot::BarPlot &bp, const vector<double> &x,
+                 const vector<double> &y) {
+  return bp.SetBrush("BorderTop", "\u2581")
+      .SetBrush("BorderLeft", "\u2595")
+      .SetBrush("BorderRight", "\u258F")
+      .SetBrush("Area", "\u2588")
+      .PlotBars(x, y)
+      .Serialize();
+}
+
+// Aggregates text from a pipe or other input that can only be read once,
+// without keeping it. Columnar input, recognized by its header, has to be
+// read whole.
+int aggregate_once(const Options &options, int fd) {
+  vector<char> head(1 << 16);
+  size_t size = 0;
+  while (size < sizeof(ingest::kColumnarMagic)) {
+    const ssize_t n = read(fd, head.data() + size, head.size() - size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      cerr << "Error: " << strerror(errno) << endl;
       return 1;
     }
-    in = &file;
+    if (n == 0) {
+      break;
+    }
+    size += n;
   }
 
-  vector<double> x, y;
-  string line;
-  int row = 0;
-  while (getline(*in, line)) {
-    trim(line);
-    if (line.empty())
-      continue;
-    vector<string> tokens;
-    split(line, tokens);
-    if (tokens.size() == 1) {
-      try {
-        x.push_back(row);
-        y.push_back(stod(tokens[0]));
-        ++row;
-      } catch (...) {
-        cerr << "Error: Invalid number in line: " << line << endl;
+  askiplot::BarPlot bp;
+  ingest::Columns columns;
+  const auto *data = reinterpret_cast<const uint8_t *>(head.data());
+  if (ingest::is_columnar(data, size)) {
+    head.resize(size);
+    char block[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, block, sizeof(block))) != 0) {
+      if (n > 0) {
+        head.insert(head.end(), block, block + n);
+      } else if (errno != EINTR) {
+        cerr << "Error: " << strerror(errno) << endl;
         return 1;
       }
-    } else if (tokens.size() == 2) {
-      try {
-        x.push_back(stod(tokens[0]));
-        y.push_back(stod(tokens[1]));
-      } catch (...) {
-        cerr << "Error: Invalid number in line: " << line << endl;
-        return 1;
+    }
+    const ingest::BinaryTable table = ingest::read_columnar(
+        reinterpret_cast<const uint8_t *>(head.data()), head.size());
+    if (!table.error.empty()) {
+      cerr << "Error: " << table.error << endl;
+      return 1;
+    }
+    columns = ingest::aggregate_binary(table, bp.GetWidth(), options.agg);
+  } else {
+    columns = ingest::aggregate_stream(fd, head.data(), head.data() + size,
+                                       bp.GetWidth(), options.agg);
+  }
+  if (!columns.error.empty()) {
+    cerr << "Error: " << columns.error << endl;
+    return 1;
+  }
+  cout << draw_bars(bp, columns.x, columns.y) << "\n";
+  return 0;
+}
+
+int follow(const Options &options) {
+  ingest::FollowReader reader(options.path.empty() ? "-" : options.path);
+  if (!reader.is_open()) {
+    cerr << "Error: Cannot open file " << options.path << endl;
+    return 1;
+  }
+
+  using Clock = chrono::steady_clock;
+  const auto period = chrono::microseconds(1000000 / options.fps);
+  RingBuffer<pair<double, double>> window(options.window);
+  size_t one_column_rows = 0;
+  bool pending = false;
+  bool first_frame = true;
+  auto last_draw = Clock::now() - period;
+
+  while (true) {
+    reader.read_available([&](const char *line, const char *line_end) {
+      double values[2];
+      switch (ingest::parse_line(line, line_end, values)) {
+      case ingest::kOneColumn:
+        window.push({static_cast<double>(one_column_rows++), values[0]});
+        pending = true;
+        break;
+      case ingest::kTwoColumns:
+        window.push({values[0], values[1]});
+        pending = true;
+        break;
+      default:
+        break;
       }
-    } else {
-      cerr << "Error: Invalid line (expect 1 or 2 columns): " << line << endl;
+    });
+
+    const auto now = Clock::now();
+    if (pending && (now - last_draw >= period || reader.at_end())) {
+      askiplot::BarPlot bp;
+      ingest::Columns columns;
+      columns.x.resize(window.size());
+      columns.y.resize(window.size());
+      for (size_t i = 0; i < window.size(); ++i) {
+        columns.x[i] = window[i].first;
+        columns.y[i] = window[i].second;
+      }
+      const size_t width = bp.GetWidth();
+      if (options.aggregate && columns.x.size() > width) {
+        const auto range = minmax_element(columns.x.begin(), columns.x.end());
+        ingest::BucketAggregator buckets(width, *range.first, *range.second,
+                                         options.agg);
+        for (size_t i = 0; i < columns.x.size(); ++i) {
+          buckets.add(columns.x[i], columns.y[i]);
+        }
+        columns = buckets.result();
+      }
+      // Home the cursor and overwrite the previous frame, clearing the
+      // screen only once to avoid flickering. A newline after a frame as
+      // tall as the terminal would scroll it.
+      cout << (first_frame ? "\x1b[H\x1b[2J" : "\x1b[H") << draw_bars(bp, columns.x, columns.y)
+           << flush;
+      first_frame = false;
+      pending = false;
+      last_draw = now;
+    }
+    if (reader.at_end()) {
+      cout << "\n";
+      return 0;
+    }
+
+    // Sleep until input arrives, but not past the next allowed redraw of
+    // data already pending
+    int timeout_ms = 1000;
+    if (pending) {
+      const auto left = chrono::duration_cast<chrono::milliseconds>(
+          last_draw + period - now);
+      timeout_ms = max<int>(1, left.count());
+    }
+    reader.wait(timeout_ms);
+  }
+}
+
+} // private namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    cerr << "Usage: " << argv[0]
+         << " [--format=text|f32|f64|i64] [--columns=N]"
+         << " [--agg=mean|max|min|sum|p99] [--follow] [--window=N] [--fps=N]"
+         << " [file]" << endl;
+    return 1;
+  }
+  if (options.follow) {
+    return follow(options);
+  }
+
+  const string path = options.path.empty() ? "/dev/stdin" : options.path;
+  if (options.aggregate && !options.binary) {
+    const int fd = options.path.empty() ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && !S_ISREG(st.st_mode)) {
+      return aggregate_once(options, fd);
+    }
+    if (fd > STDIN_FILENO) {
+      close(fd);
+    }
+  }
+
+  unique_ptr<askiplot::MappedFile> input;
+  try {
+    input = make_unique<askiplot::MappedFile>(path);
+  } catch (const askiplot::FileNotReadable &) {
+    cerr << "Error: Cannot open file " << path << endl;
+    return 1;
+  }
+  const uint8_t *data = input->GetData();
+  const size_t size = input->GetSize();
+  const char *begin = reinterpret_cast<const char *>(data);
+  const char *end = begin + size;
+
+  // Sized from the terminal, so only made early when bucketing needs the
+  // width, and otherwise after errors in the input are reported
+  unique_ptr<askiplot::BarPlot> bp;
+  if (options.aggregate) {
+    bp = make_unique<askiplot::BarPlot>();
+  }
+  ingest::Columns columns;
+  if (options.binary || ingest::is_columnar(data, size)) {
+    const ingest::BinaryTable table =
+        options.binary ? ingest::read_raw(data, size, options.type, options.columns)
+                       : ingest::read_columnar(data, size);
+    if (!table.error.empty()) {
+      cerr << "Error: " << table.error << endl;
       return 1;
     }
+    columns = options.aggregate
+                  ? ingest::aggregate_binary(table, bp->GetWidth(), options.agg)
+                  : ingest::binary_columns(table);
+  } else {
+    columns = options.aggregate
+                  ? ingest::aggregate_columns(begin, end, bp->GetWidth(), options.agg)
+                  : ingest::parse_columns(begin, end);
+  }
+  if (!columns.error.empty()) {
+    cerr << "Error: " << columns.error << endl;
+    return 1;
   }
 
-  askiplot::BarPlot bp;
-  cout << bp.SetBrush("BorderTop", "\u2581")
-              .SetBrush("BorderLeft", "\u2595")
-              .SetBrush("BorderRight", "\u258F")
-              .SetBrush("Area", "\u2588")
-              .PlotBars(x, y)
-              .Serialize()
-       << "\n";
+  if (!bp) {
+    bp = make_unique<askiplot::BarPlot>();
+  }
+  cout << draw_bars(*bp, columns.x, columns.y) << "\n";
 
   return 0;
 }
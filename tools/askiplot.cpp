@@ -0,0 +1,496 @@
+// Plots numerical columns read from a file or stdin, as one or more charts.
+//
+// clang-format off
+// Usage: askiplot.out [--size=WxH] [--grid=RxC] [--format=FMT] [--columns=N] [file]
+//                     MODE [OPTIONS] [MODE [OPTIONS] ...]
+//
+// Modes:
+//   bars      One bar per row. With more rows than columns, rows are
+//             bucketed and each bucket shows their mean, or --agg.
+//   hist      Histogram of a column.
+//   scatter   Points of one or more series.
+//   line      Lines through the points of one or more series.
+//   heatmap   Density of the points, darker where more of them fall.
+//
+// Options of each mode:
+//   --x=COL            Column of x (default: the first of two or more
+//                      columns, otherwise the row index)
+//   --y=COL[,COL...]   Columns of y, several only for scatter and line
+//                      (default: the second column, or the only one)
+//   --title=TEXT       Title of the chart
+//   --agg=mean|max|min|sum|p99   Aggregate of the bucketed bars
+// clang-format on
+//
+// Columns are chosen by their 1-based index or, if the first line is a
+// header, by name. They are separated as in askibars, and are parsed once
+// for all charts. Charts are stacked vertically unless --grid arranges them
+// in rows and columns, filled row by row. The size defaults to that of the
+// terminal, or to 80x24 when there is none.
+//
+// Binary input is read as in askibars: --format=f32|f64|i64 takes rows of
+// --columns=N raw values, and columnar files are recognized by their
+// header, which also names their columns.
+//
+// clang-format off
+// $ askiplot.out latency.csv line --y=p50,p99 --title=Latency hist --y=p99
+// $ seq 1000 | awk '{print sin($1/50), cos($1/30)}' | askiplot.out --grid=1x2 scatter heatmap
+// clang-format on
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "askiplot.hpp"
+#include "ingest.hpp"
+
+using namespace std;
+
+namespace {
+
+enum ChartKind { kBars, kHist, kScatter, kLine, kHeatmap };
+
+struct ChartSpec {
+  ChartKind kind;
+  string x; // Empty for the default
+  vector<string> y;
+  string title;
+  ingest::Aggregate agg = ingest::kMean;
+
+  // Indices into the parsed table, x is -1 for the row index
+  int x_slot = -1;
+  vector<size_t> y_slots;
+};
+
+struct Options {
+  string path = "/dev/stdin";
+  int width = 0, height = 0;
+  int grid_rows = 0, grid_cols = 0;
+  bool binary = false;
+  ingest::ValueType type = ingest::kFloat64;
+  size_t columns = 1;
+  vector<ChartSpec> charts;
+};
+
+bool parse_kind(const string &name, ChartKind &kind) {
+  static const pair<const char *, ChartKind> kNames[] = {
+      {"bars", kBars}, {"hist", kHist}, {"scatter", kScatter},
+      {"line", kLine}, {"heatmap", kHeatmap}};
+  for (const auto &entry : kNames) {
+    if (name == entry.first) {
+      kind = entry.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Parses "AxB" into two positive integers
+void parse_pair(const string &text, int &a, int &b) {
+  char *end = nullptr;
+  a = strtol(text.c_str(), &end, 10);
+  if (*end != 'x' || a <= 0) {
+    throw runtime_error("Invalid size: " + text);
+  }
+  const char *second = end + 1;
+  b = strtol(second, &end, 10);
+  if (end == second || *end != '\0' || b <= 0) {
+    throw runtime_error("Invalid size: " + text);
+  }
+}
+
+vector<string> split_list(const string &text) {
+  vector<string> items;
+  size_t begin = 0;
+  while (true) {
+    const size_t comma = text.find(',', begin);
+    items.push_back(text.substr(begin, comma - begin));
+    if (comma == string::npos) {
+      return items;
+    }
+    begin = comma + 1;
+  }
+}
+
+Options parse_options(int argc, char *argv[]) {
+  Options options;
+  bool has_path = false;
+  for (int i = 1; i < argc; ++i) {
+    const string arg = argv[i];
+    const size_t eq = arg.find('=');
+    const string key = arg.substr(0, eq);
+    const string value = eq == string::npos ? "" : arg.substr(eq + 1);
+    ChartKind kind;
+    if (parse_kind(arg, kind)) {
+      options.charts.push_back(ChartSpec{});
+      options.charts.back().kind = kind;
+    } else if (!options.charts.empty() && key == "--x") {
+      options.charts.back().x = value;
+    } else if (!options.charts.empty() && key == "--y") {
+      options.charts.back().y = split_list(value);
+    } else if (!options.charts.empty() && key == "--title") {
+      options.charts.back().title = value;
+    } else if (!options.charts.empty() && key == "--agg") {
+      if (!ingest::parse_aggregate(value, options.charts.back().agg)) {
+        throw runtime_error("Invalid aggregate: " + value);
+      }
+    } else if (options.charts.empty() && key == "--size") {
+      parse_pair(value, options.width, options.height);
+    } else if (options.charts.empty() && key == "--grid") {
+      parse_pair(value, options.grid_rows, options.grid_cols);
+    } else if (options.charts.empty() && key == "--format") {
+      options.binary = value != "text";
+      if (options.binary && !ingest::parse_value_type(value, options.type)) {
+        throw runtime_error("Invalid format: " + value);
+      }
+    } else if (options.charts.empty() && key == "--columns") {
+      char *end = nullptr;
+      options.columns = strtoul(value.c_str(), &end, 10);
+      if (value.empty() || *end != '\0' || options.columns == 0) {
+        throw runtime_error("Invalid number of columns: " + value);
+      }
+    } else if (options.charts.empty() && !has_path &&
+               (arg == "-" || arg[0] != '-')) {
+      options.path = arg == "-" ? "/dev/stdin" : arg;
+      has_path = true;
+    } else {
+      throw runtime_error("Unexpected argument: " + arg);
+    }
+  }
+  if (options.charts.empty()) {
+    throw runtime_error("No chart requested");
+  }
+  if (options.grid_rows == 0) {
+    options.grid_rows = options.charts.size();
+    options.grid_cols = 1;
+  }
+  if (static_cast<size_t>(options.grid_rows) * options.grid_cols <
+      options.charts.size()) {
+    throw runtime_error("The grid is too small for all charts");
+  }
+  return options;
+}
+
+// Zero-based index of a column given by 1-based index or by name
+size_t find_column(const string &column, const vector<string> &names,
+                   size_t fields) {
+  if (!column.empty() &&
+      all_of(column.begin(), column.end(), [](char c) { return isdigit(c); })) {
+    const size_t index = stoul(column);
+    if (index == 0 || index > fields) {
+      throw runtime_error("No column " + column);
+    }
+    return index - 1;
+  }
+  const auto it = find(names.begin(), names.end(), column);
+  if (it == names.end()) {
+    throw runtime_error("Unknown column: " + column);
+  }
+  return it - names.begin();
+}
+
+// Picks the columns of every chart, returning the distinct ones to parse
+vector<size_t> resolve_columns(Options &options, const vector<string> &names,
+                               size_t fields) {
+  vector<size_t> wanted;
+  auto slot_of = [&wanted](size_t column) {
+    const auto it = find(wanted.begin(), wanted.end(), column);
+    if (it != wanted.end()) {
+      return static_cast<size_t>(it - wanted.begin());
+    }
+    wanted.push_back(column);
+    return wanted.size() - 1;
+  };
+
+  for (auto &chart : options.charts) {
+    if (!chart.x.empty()) {
+      chart.x_slot = slot_of(find_column(chart.x, names, fields));
+    } else if (fields >= 2 && chart.kind != kHist) {
+      chart.x_slot = slot_of(0);
+    }
+    if (chart.y.empty()) {
+      chart.y.push_back(fields >= 2 ? "2" : "1");
+    }
+    const bool multiple = chart.kind == kScatter || chart.kind == kLine;
+    if (chart.y.size() > 1 && !multiple) {
+      throw runtime_error("Only scatter and line charts take several columns");
+    }
+    for (const auto &column : chart.y) {
+      chart.y_slots.push_back(slot_of(find_column(column, names, fields)));
+    }
+  }
+  return wanted;
+}
+
+string column_label(const string &column, const vector<string> &names) {
+  if (names.empty() || !all_of(column.begin(), column.end(),
+                               [](char c) { return isdigit(c); })) {
+    return column;
+  }
+  return names[stoul(column) - 1];
+}
+
+// Limits fitting all series, widened when they span no range
+// Widens [lo, hi] to the finite values of v: nan and inf parse as numbers
+void widen_range(const vector<double> &v, double &lo, double &hi) {
+  for (double value : v) {
+    if (isfinite(value)) {
+      lo = min(lo, value);
+      hi = max(hi, value);
+    }
+  }
+}
+
+void set_limits(askiplot::Plot &plot, const vector<double> &x,
+                const vector<const vector<double> *> &ys) {
+  double x0 = HUGE_VAL, x1 = -HUGE_VAL;
+  widen_range(x, x0, x1);
+  double y0 = HUGE_VAL, y1 = -HUGE_VAL;
+  for (const auto *y : ys) {
+    widen_range(*y, y0, y1);
+  }
+  if (x0 > x1) {
+    x0 = x1 = 0;
+  }
+  if (y0 > y1) {
+    y0 = y1 = 0;
+  }
+  const double xm = x1 > x0 ? (x1 - x0) * 0.01 : 0.5;
+  const double ym = y1 > y0 ? (y1 - y0) * 0.02 : 0.5;
+  plot.AutoLimit(askiplot::None)
+      .SetXlimits(x0 - xm, x1 + xm)
+      .SetYlimits(y0 - ym, y1 + ym);
+}
+
+class ChartBuilder {
+public:
+  explicit ChartBuilder(const ingest::Table &table) : table_(table) {
+    const size_t rows = table.columns.empty() ? 0 : table.columns[0].size();
+    index_.resize(rows);
+    for (size_t i = 0; i < rows; ++i) {
+      index_[i] = i;
+    }
+  }
+
+  unique_ptr<askiplot::IPlot> build(const ChartSpec &chart, int width,
+                                    int height) const {
+    const vector<double> &x =
+        chart.x_slot >= 0 ? table_.columns[chart.x_slot] : index_;
+    vector<const vector<double> *> ys;
+    vector<string> labels;
+    for (size_t k = 0; k < chart.y.size(); ++k) {
+      ys.push_back(&table_.columns[chart.y_slots[k]]);
+      labels.push_back(column_label(chart.y[k], table_.names));
+    }
+
+    unique_ptr<askiplot::IPlot> plot;
+    switch (chart.kind) {
+    case kBars:
+      plot = bars(chart, x, *ys[0], labels[0], width, height);
+      break;
+    case kHist:
+      plot = hist(chart, *ys[0], labels[0], width, height);
+      break;
+    case kScatter:
+    case kLine:
+      plot = series(chart, x, ys, labels, width, height);
+      break;
+    case kHeatmap:
+      plot = heatmap(chart, x, *ys[0], width, height);
+      break;
+    }
+    return plot;
+  }
+
+private:
+  const ingest::Table &table_;
+  vector<double> index_;
+
+  template <class T>
+  static unique_ptr<askiplot::IPlot> finish(unique_ptr<T> plot,
+                                            const string &title) {
+    if (!title.empty()) {
+      plot->SetTitle(title).DrawTitle();
+    }
+    return plot;
+  }
+
+  unique_ptr<askiplot::IPlot> bars(const ChartSpec &chart,
+                                   const vector<double> &x,
+                                   const vector<double> &y,
+                                   const string &label, int width,
+                                   int height) const {
+    auto plot = make_unique<askiplot::BarPlot>(width, height);
+    plot->SetBrush("BorderTop", "\u2581")
+        .SetBrush("BorderLeft", "\u2595")
+        .SetBrush("BorderRight", "\u258F")
+        .SetBrush("Area", "\u2588");
+    if (y.size() > static_cast<size_t>(width)) {
+      const auto range = minmax_element(x.begin(), x.end());
+      ingest::BucketAggregator buckets(width, *range.first, *range.second,
+                                       chart.agg);
+      for (size_t i = 0; i < x.size(); ++i) {
+        buckets.add(x[i], y[i]);
+      }
+      const ingest::Columns reduced = buckets.result();
+      plot->PlotBars(reduced.x, reduced.y, label);
+    } else {
+      plot->PlotBars(x, y, label);
+    }
+    return finish(move(plot), chart.title);
+  }
+
+  unique_ptr<askiplot::IPlot> hist(const ChartSpec &chart,
+                                   const vector<double> &y, const string &label,
+                                   int width, int height) const {
+    const auto range = minmax_element(y.begin(), y.end());
+    if (*range.first == *range.second) {
+      throw runtime_error("A histogram needs at least two distinct values");
+    }
+    auto plot = make_unique<askiplot::HistPlot>(width, height);
+    plot->PlotHistogram(y, label);
+    return finish(move(plot), chart.title);
+  }
+
+  unique_ptr<askiplot::IPlot> series(const ChartSpec &chart,
+                                     const vector<double> &x,
+                                     const vector<const vector<double> *> &ys,
+                                     const vector<string> &labels, int width,
+                                     int height) const {
+    static const char *kGlyphs[] = {"*", "+", "o", "x", "#", "%", "@", "="};
+    auto plot = make_unique<askiplot::Plot>(width, height);
+    set_limits(*plot, x, ys);
+    for (size_t k = 0; k < ys.size(); ++k) {
+      const vector<double> &y = *ys[k];
+      plot->SetMainBrush(kGlyphs[k % size(kGlyphs)]).PlotData(x, y, labels[k]);
+      if (chart.kind == kLine) {
+        for (size_t i = 1; i < x.size(); ++i) {
+          plot->DrawLine(x[i - 1], y[i - 1], x[i], y[i]);
+        }
+      }
+    }
+    if (ys.size() > 1) {
+      plot->DrawLegendAuto();
+    }
+    return finish(move(plot), chart.title);
+  }
+
+  // Counts of points per cell, on a logarithmic scale
+  unique_ptr<askiplot::IPlot> heatmap(const ChartSpec &chart,
+                                      const vector<double> &x,
+                                      const vector<double> &y, int width,
+                                      int height) const {
+    auto plot = make_unique<askiplot::Plot>(width, height);
+    set_limits(*plot, x, {&y});
+    const double x0 = plot->GetXlimLeft(), x1 = plot->GetXlimRight();
+    const double y0 = plot->GetYlimBottom(), y1 = plot->GetYlimTop();
+
+    vector<uint32_t> counts(static_cast<size_t>(width) * height, 0);
+    for (size_t i = 0; i < x.size(); ++i) {
+      if (!isfinite(x[i]) || !isfinite(y[i])) {
+        continue;
+      }
+      const double u = (x[i] - x0) / (x1 - x0) * width;
+      const double v = (y1 - y[i]) / (y1 - y0) * height;
+      const int col = static_cast<int>(clamp(u, 0.0, width - 1.0));
+      const int row = static_cast<int>(clamp(v, 0.0, height - 1.0));
+      ++counts[static_cast<size_t>(row) * width + col];
+    }
+
+    // Any point shows, as only level 0 maps to a blank
+    const askiplot::FixedGamma gamma(" .:-=+*#%@");
+    const double top = log1p(*max_element(counts.begin(), counts.end()));
+    vector<uint8_t> levels(counts.size());
+    for (size_t i = 0; i < counts.size(); ++i) {
+      levels[i] = counts[i] == 0 ? 0 : 26 + 229 * log1p(counts[i]) / top;
+    }
+    plot->DrawImage(askiplot::Image(width, height, levels), gamma);
+    return finish(move(plot), chart.title);
+  }
+};
+
+} // private namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    Options options = parse_options(argc, argv);
+
+    unique_ptr<askiplot::MappedFile> input;
+    try {
+      input = make_unique<askiplot::MappedFile>(options.path);
+    } catch (const askiplot::FileNotReadable &) {
+      throw runtime_error("Cannot open file " + options.path);
+    }
+    const uint8_t *data = input->GetData();
+    const size_t size = input->GetSize();
+
+    ingest::Table table;
+    if (options.binary || ingest::is_columnar(data, size)) {
+      const ingest::BinaryTable binary =
+          options.binary
+              ? ingest::read_raw(data, size, options.type, options.columns)
+              : ingest::read_columnar(data, size);
+      if (!binary.error.empty()) {
+        throw runtime_error(binary.error);
+      }
+      vector<string> names;
+      for (const auto &column : binary.columns) {
+        names.push_back(column.name);
+      }
+      const vector<size_t> wanted =
+          resolve_columns(options, names, binary.columns.size());
+      table = ingest::binary_table(binary, wanted);
+    } else {
+      const char *begin = reinterpret_cast<const char *>(data);
+      const char *end = begin + size;
+      size_t fields = 0;
+      const char *body = begin;
+      const vector<string> names = ingest::read_header(body, end, fields);
+      const vector<size_t> wanted = resolve_columns(options, names, fields);
+      table = ingest::parse_table(begin, end, wanted);
+      if (!table.error.empty()) {
+        throw runtime_error(table.error);
+      }
+    }
+    if (table.columns.empty() || table.columns[0].empty()) {
+      throw runtime_error("No data");
+    }
+
+    if (options.width == 0) {
+      try {
+        askiplot::Plot terminal;
+        options.width = terminal.GetWidth();
+        options.height = terminal.GetHeight();
+      } catch (const askiplot::InvalidTerminalSize &) {
+        options.width = 80;
+        options.height = 24;
+      }
+    }
+
+    // Cells of the grid share the size as GridPlot does
+    askiplot::GridPlot grid(options.grid_rows, options.grid_cols,
+                            options.width, options.height);
+    const ChartBuilder builder(table);
+    vector<unique_ptr<askiplot::IPlot>> plots;
+    for (size_t k = 0; k < options.charts.size(); ++k) {
+      const int row = k / options.grid_cols;
+      const int col = k % options.grid_cols;
+      const int width = options.width / options.grid_cols +
+                        (col < options.width % options.grid_cols ? 1 : 0);
+      const int height = options.height / options.grid_rows +
+                         (row < options.height % options.grid_rows ? 1 : 0);
+      plots.push_back(builder.build(options.charts[k], width, height));
+      grid.SetPlotAt(row, col, *plots.back());
+    }
+    cout << grid.Serialize();
+  } catch (const exception &e) {
+    cerr << "Error: " << e.what() << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,1321 @@
+// Allocation-free parsing of numeric text columns for the askiplot tools.
+//
+// Input is taken whole through askiplot::MappedFile, which maps regular
+// files and reads pipes into memory. Lines are found with memchr and
+// numbers converted in place with std::from_chars, so nothing is allocated
+// per line and no exception is thrown for malformed input. FollowReader
+// instead hands out lines as they arrive from inputs that keep growing.
+//
+// Binary inputs skip parsing altogether: raw arrays of little-endian
+// numbers, and the columnar format described above read_columnar, are read
+// in place from the mapped file through ColumnView.
+
+#ifndef ASKIPLOT_TOOLS_INGEST_HPP_
+#define ASKIPLOT_TOOLS_INGEST_HPP_
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <numeric>
+#include <ostream>
+#include <poll.h>
+#include <random>
+#include <string>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace ingest {
+
+enum LineStatus {
+  kBlankLine,
+  kOneColumn,
+  kTwoColumns,
+  kInvalidNumber,
+  kTooManyColumns
+};
+
+inline bool is_separator(char c) {
+  return c == ',' || c == ' ' || c == '\t' || c == '\r' || c == '\v' ||
+         c == '\f' || c == '\n';
+}
+
+// Parses a number spanning exactly [begin, end). Unlike from_chars, a
+// leading '+' is accepted, as stod did.
+inline bool parse_number(const char *begin, const char *end, double &value) {
+  if (begin != end && *begin == '+') {
+    ++begin;
+  }
+  const auto result = std::from_chars(begin, end, value);
+  return result.ec == std::errc() && result.ptr == end;
+}
+
+// Parses one line, without its newline, into up to two values. Columns are
+// separated by any run of commas, tabs or spaces.
+inline LineStatus parse_line(const char *begin, const char *end, double values[2]) {
+  int columns = 0;
+  const char *it = begin;
+  while (true) {
+    while (it != end && is_separator(*it)) {
+      ++it;
+    }
+    if (it == end) {
+      break;
+    }
+    const char *token = it;
+    while (it != end && !is_separator(*it)) {
+      ++it;
+    }
+    if (columns == 2) {
+      return kTooManyColumns;
+    }
+    if (!parse_number(token, it, values[columns])) {
+      return kInvalidNumber;
+    }
+    ++columns;
+  }
+  return columns == 0 ? kBlankLine : (columns == 1 ? kOneColumn : kTwoColumns);
+}
+
+// Calls fn(line_begin, line_end) for each line of [begin, end), stopping
+// early if fn returns false. Returns whether all lines were visited.
+template <class Fn>
+bool for_each_line(const char *begin, const char *end, Fn fn) {
+  while (begin < end) {
+    const void *newline = std::memchr(begin, '\n', end - begin);
+    const char *line_end =
+        newline != nullptr ? static_cast<const char *>(newline) : end;
+    if (!fn(begin, line_end)) {
+      return false;
+    }
+    begin = line_end + 1;
+  }
+  return true;
+}
+
+// Copy of a line for error messages, without trailing whitespace
+inline std::string line_text(const char *begin, const char *end) {
+  while (end != begin && is_separator(end[-1])) {
+    --end;
+  }
+  while (begin != end && is_separator(*begin)) {
+    ++begin;
+  }
+  return std::string(begin, end);
+}
+
+// Both columns of an input. Lines with a single number get as x their
+// index among such lines, counting from zero.
+struct Columns {
+  std::vector<double> x, y;
+  std::string error; // Empty if every line was valid
+};
+
+namespace detail {
+
+// Rows of a chunk parsed in place into the result
+struct ChunkColumns {
+  std::size_t rows = 0;
+  std::size_t one_column_rows = 0;
+  std::vector<bool> generated; // Whether x is a local single-column index
+  std::string error;
+};
+
+// Number of lines of [begin, end), the last one possibly unterminated
+inline std::size_t count_lines(const char *begin, const char *end) {
+  std::size_t lines = 0;
+  while (begin < end) {
+    const void *newline = std::memchr(begin, '\n', end - begin);
+    ++lines;
+    if (newline == nullptr) {
+      break;
+    }
+    begin = static_cast<const char *>(newline) + 1;
+  }
+  return lines;
+}
+
+// Parses the lines of [begin, end) into x and y, which have room for one
+// row per line
+inline void parse_chunk(const char *begin, const char *end, double *x, double *y,
+                        ChunkColumns &out) {
+  for_each_line(begin, end, [&](const char *line, const char *line_end) {
+    double values[2];
+    switch (parse_line(line, line_end, values)) {
+    case kBlankLine:
+      return true;
+    case kOneColumn:
+      x[out.rows] = out.one_column_rows++;
+      y[out.rows++] = values[0];
+      out.generated.push_back(true);
+      return true;
+    case kTwoColumns:
+      x[out.rows] = values[0];
+      y[out.rows++] = values[1];
+      out.generated.push_back(false);
+      return true;
+    case kInvalidNumber:
+      out.error = "Invalid number in line: " + line_text(line, line_end);
+      return false;
+    case kTooManyColumns:
+      out.error = "Invalid line (expect 1 or 2 columns): " +
+                  line_text(line, line_end);
+      return false;
+    }
+    return true;
+  });
+}
+
+// Cuts [begin, end) after newlines into up to one chunk per thread, of at
+// least 1 MiB each. Returns the chunk boundaries.
+inline std::vector<const char *> split_chunks(const char *begin, const char *end,
+                                              unsigned threads) {
+  constexpr std::size_t kMinChunkBytes = 1 << 20;
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  const std::size_t size = end - begin;
+  const std::size_t chunks =
+      std::max<std::size_t>(1, std::min<std::size_t>(threads, size / kMinChunkBytes));
+
+  std::vector<const char *> bounds(chunks + 1, end);
+  bounds[0] = begin;
+  for (std::size_t k = 1; k < chunks; ++k) {
+    const char *cut = std::max(bounds[k - 1], begin + size * k / chunks);
+    const void *newline = std::memchr(cut, '\n', end - cut);
+    bounds[k] = newline != nullptr ? static_cast<const char *>(newline) + 1 : end;
+  }
+  return bounds;
+}
+
+template <class Fn>
+void run_parallel(std::size_t tasks, Fn fn) {
+  std::vector<std::thread> workers;
+  for (std::size_t t = 1; t < tasks; ++t) {
+    workers.emplace_back(fn, t);
+  }
+  fn(0);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+} // namespace detail
+
+// Parses all lines of [begin, end). The input is cut at newlines into one
+// chunk per thread. Lines are counted first, so that chunks are parsed
+// concurrently straight into the result at their offsets, without
+// intermediate buffers. On error the message is that of the first invalid
+// line of the input.
+inline Columns parse_columns(const char *begin, const char *end,
+                             unsigned threads = 0) {
+  const std::vector<const char *> bounds = detail::split_chunks(begin, end, threads);
+  const std::size_t chunks = bounds.size() - 1;
+
+  // Where each chunk goes, assuming no blank lines
+  std::vector<std::size_t> offsets(chunks + 1, 0);
+  detail::run_parallel(chunks, [&](std::size_t k) {
+    offsets[k + 1] = detail::count_lines(bounds[k], bounds[k + 1]);
+  });
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+  Columns columns;
+  columns.x.resize(offsets[chunks]);
+  columns.y.resize(offsets[chunks]);
+  std::vector<detail::ChunkColumns> parsed(chunks);
+  detail::run_parallel(chunks, [&](std::size_t k) {
+    detail::parse_chunk(bounds[k], bounds[k + 1], columns.x.data() + offsets[k],
+                        columns.y.data() + offsets[k], parsed[k]);
+  });
+
+  for (const auto &chunk : parsed) {
+    if (!chunk.error.empty()) {
+      return Columns{{}, {}, chunk.error};
+    }
+  }
+
+  // Close the gaps left by blank lines, always moving rows down, and give
+  // single-column lines their index in the whole input
+  std::size_t rows = 0;
+  std::size_t first_index = 0;
+  for (std::size_t k = 0; k < chunks; ++k) {
+    const auto &chunk = parsed[k];
+    double *x = columns.x.data() + rows;
+    if (rows != offsets[k]) {
+      std::memmove(x, columns.x.data() + offsets[k], chunk.rows * sizeof(double));
+      std::memmove(columns.y.data() + rows, columns.y.data() + offsets[k],
+                   chunk.rows * sizeof(double));
+    }
+    if (first_index != 0 && chunk.one_column_rows != 0) {
+      for (std::size_t i = 0; i < chunk.rows; ++i) {
+        if (chunk.generated[i]) {
+          x[i] += first_index;
+        }
+      }
+    }
+    rows += chunk.rows;
+    first_index += chunk.one_column_rows;
+  }
+  columns.x.resize(rows);
+  columns.y.resize(rows);
+  return columns;
+}
+
+// Calls fn(field_begin, field_end, index) for each field of a line, split
+// like parse_line does
+template <class Fn>
+void for_each_field(const char *begin, const char *end, Fn fn) {
+  std::size_t index = 0;
+  const char *it = begin;
+  while (true) {
+    while (it != end && is_separator(*it)) {
+      ++it;
+    }
+    if (it == end) {
+      return;
+    }
+    const char *field = it;
+    while (it != end && !is_separator(*it)) {
+      ++it;
+    }
+    fn(field, it, index++);
+  }
+}
+
+// Some columns of an input with any number of columns
+struct Table {
+  std::vector<std::string> names; // Fields of the header line, if any
+  std::vector<std::vector<double>> columns; // In the order requested
+  std::size_t fields = 0; // Fields in the header or first data line
+  std::string error;
+};
+
+// Reads the first non-blank line, advancing begin past it if it is a header,
+// i.e. if any of its fields is not a number
+inline std::vector<std::string> read_header(const char *&begin, const char *end,
+                                            std::size_t &fields) {
+  std::vector<std::string> names;
+  fields = 0;
+  for_each_line(begin, end, [&](const char *line, const char *line_end) {
+    bool numeric = true;
+    for_each_field(line, line_end, [&](const char *field, const char *field_end,
+                                       std::size_t) {
+      double value;
+      numeric = numeric && parse_number(field, field_end, value);
+      names.emplace_back(field, field_end);
+    });
+    if (names.empty()) {
+      return true;
+    }
+    fields = names.size();
+    if (numeric) {
+      names.clear();
+    } else {
+      begin = line_end;
+    }
+    return false;
+  });
+  return names;
+}
+
+namespace detail {
+
+inline void parse_table_chunk(const char *begin, const char *end,
+                              const std::vector<int> &slots, std::size_t wanted,
+                              Table &out) {
+  out.columns.resize(wanted);
+  std::vector<double> row(wanted);
+  for_each_line(begin, end, [&](const char *line, const char *line_end) {
+    std::size_t fields = 0;
+    bool valid = true;
+    for_each_field(line, line_end, [&](const char *field, const char *field_end,
+                                       std::size_t index) {
+      fields = index + 1;
+      if (valid && index < slots.size() && slots[index] >= 0) {
+        valid = parse_number(field, field_end, row[slots[index]]);
+      }
+    });
+    if (fields == 0) {
+      return true;
+    }
+    if (fields < slots.size()) {
+      out.error = "Invalid line (expect at least " + std::to_string(slots.size()) +
+                  " columns): " + line_text(line, line_end);
+      return false;
+    }
+    if (!valid) {
+      out.error = "Invalid number in line: " + line_text(line, line_end);
+      return false;
+    }
+    for (std::size_t k = 0; k < wanted; ++k) {
+      out.columns[k].push_back(row[k]);
+    }
+    return true;
+  });
+}
+
+} // namespace detail
+
+// Parses the columns of the given zero-based indices, which must be
+// distinct. A header line is detected by read_header and its fields are
+// returned as column names. Fields other than the requested ones are not
+// converted, so they may hold anything.
+inline Table parse_table(const char *begin, const char *end,
+                         const std::vector<std::size_t> &wanted,
+                         unsigned threads = 0) {
+  Table table;
+  table.names = read_header(begin, end, table.fields);
+  if (wanted.empty()) {
+    return table;
+  }
+
+  std::vector<int> slots;
+  for (std::size_t k = 0; k < wanted.size(); ++k) {
+    if (slots.size() <= wanted[k]) {
+      slots.resize(wanted[k] + 1, -1);
+    }
+    slots[wanted[k]] = k;
+  }
+
+  const std::vector<const char *> bounds = detail::split_chunks(begin, end, threads);
+  const std::size_t chunks = bounds.size() - 1;
+  std::vector<Table> parsed(chunks);
+  detail::run_parallel(chunks, [&](std::size_t k) {
+    detail::parse_table_chunk(bounds[k], bounds[k + 1], slots, wanted.size(),
+                              parsed[k]);
+  });
+
+  for (const auto &chunk : parsed) {
+    if (!chunk.error.empty()) {
+      table.error = chunk.error;
+      return table;
+    }
+  }
+  if (chunks == 1) {
+    table.columns = std::move(parsed[0].columns);
+    return table;
+  }
+
+  std::vector<std::size_t> offsets(chunks + 1, 0);
+  for (std::size_t k = 0; k < chunks; ++k) {
+    offsets[k + 1] = offsets[k] + parsed[k].columns[0].size();
+  }
+  table.columns.assign(wanted.size(), std::vector<double>(offsets[chunks]));
+  detail::run_parallel(chunks, [&](std::size_t k) {
+    for (std::size_t c = 0; c < wanted.size(); ++c) {
+      std::copy(parsed[k].columns[c].begin(), parsed[k].columns[c].end(),
+                table.columns[c].begin() + offsets[k]);
+    }
+  });
+  return table;
+}
+
+enum Aggregate { kMean, kMax, kMin, kSum, kP99 };
+
+inline bool parse_aggregate(const std::string &name, Aggregate &aggregate) {
+  static const std::pair<const char *, Aggregate> kNames[] = {
+      {"mean", kMean}, {"max", kMax}, {"min", kMin}, {"sum", kSum}, {"p99", kP99}};
+  for (const auto &entry : kNames) {
+    if (name == entry.first) {
+      aggregate = entry.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+namespace detail {
+
+// Aggregates of the y values falling in one bucket
+struct Bucket {
+  static constexpr std::size_t kSampleSize = 1024;
+
+  std::size_t count = 0;
+  double sum = 0;
+  double min = std::numeric_limits<double>::infinity();
+  double max = -std::numeric_limits<double>::infinity();
+  std::vector<double> sample;
+
+  void add(double y, Aggregate aggregate, std::minstd_rand &rng) {
+    ++count;
+    sum += y;
+    min = std::min(min, y);
+    max = std::max(max, y);
+    if (aggregate == kP99) {
+      // Algorithm R: the n-th point replaces a sample with probability K/n
+      if (sample.size() < kSampleSize) {
+        sample.push_back(y);
+      } else {
+        const std::size_t j = rng() % count;
+        if (j < kSampleSize) {
+          sample[j] = y;
+        }
+      }
+    }
+  }
+
+  void merge(Bucket &other, Aggregate aggregate, std::minstd_rand &rng) {
+    if (aggregate == kP99) {
+      merge_samples(other, rng);
+    }
+    count += other.count;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+  }
+
+  double value(Aggregate aggregate) const {
+    switch (aggregate) {
+    case kMean:
+      return sum / count;
+    case kMax:
+      return max;
+    case kMin:
+      return min;
+    case kSum:
+      return sum;
+    case kP99: {
+      // Nearest rank
+      std::vector<double> sorted = sample;
+      const std::size_t rank = (sorted.size() * 99 + 99) / 100;
+      std::nth_element(sorted.begin(), sorted.begin() + rank - 1, sorted.end());
+      return sorted[rank - 1];
+    }
+    }
+    return 0.0;
+  }
+
+  // Keeps from each side a share of the samples proportional to the points
+  // it stands for
+  void merge_samples(Bucket &other, std::minstd_rand &rng) {
+    if (sample.size() + other.sample.size() <= kSampleSize) {
+      sample.insert(sample.end(), other.sample.begin(), other.sample.end());
+      return;
+    }
+    std::size_t from_this = static_cast<std::size_t>(
+        static_cast<double>(kSampleSize) * count / (count + other.count) + 0.5);
+    from_this = std::min(from_this, sample.size());
+    from_this = std::max(from_this,
+                         kSampleSize - std::min(kSampleSize, other.sample.size()));
+    std::shuffle(sample.begin(), sample.end(), rng);
+    std::shuffle(other.sample.begin(), other.sample.end(), rng);
+    sample.resize(from_this);
+    sample.insert(sample.end(), other.sample.begin(),
+                  other.sample.begin() + (kSampleSize - from_this));
+  }
+};
+
+// One point per bucket, with the bucket index as x. Empty buckets are 0.
+inline Columns bucket_columns(const std::vector<Bucket> &buckets,
+                              Aggregate aggregate) {
+  Columns columns;
+  columns.x.resize(buckets.size());
+  columns.y.resize(buckets.size());
+  for (std::size_t k = 0; k < buckets.size(); ++k) {
+    columns.x[k] = k;
+    columns.y[k] = buckets[k].count > 0 ? buckets[k].value(aggregate) : 0.0;
+  }
+  return columns;
+}
+
+} // namespace detail
+
+// Reduces points to a fixed number of buckets evenly splitting [min_x,
+// max_x], in memory proportional to the number of buckets. All aggregates
+// are exact except p99, which is taken from a uniform sample of each bucket
+// and so is exact only for buckets of up to kSampleSize points. Aggregators
+// merged together should be given different seeds, or their samples are
+// drawn alike.
+class BucketAggregator {
+public:
+  static constexpr std::size_t kSampleSize = detail::Bucket::kSampleSize;
+
+  BucketAggregator(std::size_t buckets, double min_x, double max_x,
+                   Aggregate aggregate, unsigned seed = 1)
+      : buckets_(std::max<std::size_t>(1, buckets)), min_x_(min_x),
+        scale_(max_x > min_x ? buckets_.size() / (max_x - min_x) : 0.0),
+        aggregate_(aggregate), rng_(seed) {}
+
+  void add(double x, double y) {
+    const double position = (x - min_x_) * scale_;
+    const std::size_t k = std::min<std::size_t>(
+        position > 0 ? static_cast<std::size_t>(position) : 0,
+        buckets_.size() - 1);
+    buckets_[k].add(y, aggregate_, rng_);
+  }
+
+  // Folds in an aggregator built with the same buckets over other points
+  void merge(BucketAggregator &other) {
+    for (std::size_t k = 0; k < buckets_.size(); ++k) {
+      buckets_[k].merge(other.buckets_[k], aggregate_, rng_);
+    }
+  }
+
+  // One point per bucket, with the bucket index as x. Empty buckets are 0.
+  Columns result() const { return detail::bucket_columns(buckets_, aggregate_); }
+
+private:
+  std::vector<detail::Bucket> buckets_;
+  double min_x_;
+  double scale_;
+  Aggregate aggregate_;
+  std::minstd_rand rng_;
+};
+
+// Aggregates lines fed in blocks as they are read, when the range of x is
+// not known in advance and the input cannot be read twice. Points go to a
+// grid of kResolution cells per bucket, whose span doubles, merging pairs
+// of cells, whenever a point falls outside of it. The result then splits
+// [min_x, max_x] like BucketAggregator: sums and means share each cell
+// among the buckets it overlaps, the other aggregates give it to the bucket
+// holding its center. Memory is proportional to the number of buckets.
+class StreamAggregator {
+public:
+  static constexpr std::size_t kResolution = 4;
+
+  StreamAggregator(std::size_t buckets, Aggregate aggregate)
+      : buckets_(std::max<std::size_t>(1, buckets)),
+        cells_(kResolution * buckets_), aggregate_(aggregate) {}
+
+  // Feeds the next bytes of the input; lines may span calls. Returns false
+  // once an invalid line was found, see error().
+  bool feed(const char *begin, const char *end) {
+    if (!error_.empty()) {
+      return false;
+    }
+    if (!carry_.empty()) {
+      const void *newline = std::memchr(begin, '\n', end - begin);
+      if (newline == nullptr) {
+        carry_.append(begin, end);
+        return true;
+      }
+      const char *line_end = static_cast<const char *>(newline);
+      carry_.append(begin, line_end);
+      const bool valid = add_line(carry_.data(), carry_.data() + carry_.size());
+      carry_.clear();
+      if (!valid) {
+        return false;
+      }
+      begin = line_end + 1;
+    }
+    const char *rest = begin;
+    const bool valid = for_each_line(begin, end, [&](const char *line, const char *line_end) {
+      if (line_end == end) {
+        // Unterminated, completed by the next block
+        rest = line;
+        return true;
+      }
+      rest = end;
+      return add_line(line, line_end);
+    });
+    carry_.assign(rest, end);
+    return valid;
+  }
+
+  // Aggregates the last line, if unterminated, and returns the buckets
+  Columns finish() {
+    if (error_.empty() && !carry_.empty()) {
+      add_line(carry_.data(), carry_.data() + carry_.size());
+      carry_.clear();
+    }
+    if (!error_.empty()) {
+      return Columns{{}, {}, error_};
+    }
+    if (min_x_ > max_x_ && first_.count == 0) {
+      return Columns{};
+    }
+
+    std::vector<detail::Bucket> buckets(buckets_);
+    if (!ranged_) {
+      buckets[0].merge(first_, aggregate_, rng_);
+      return detail::bucket_columns(buckets, aggregate_);
+    }
+    const double scale = buckets_ / (max_x_ - min_x_);
+    auto bucket = [&](double x) {
+      const double position = (x - min_x_) * scale;
+      return std::min<std::size_t>(position > 0 ? static_cast<std::size_t>(position) : 0,
+                                   buckets_ - 1);
+    };
+    if (aggregate_ != kMean && aggregate_ != kSum) {
+      for (std::size_t i = 0; i < cells_.size(); ++i) {
+        if (cells_[i].count > 0) {
+          buckets[bucket(low_ + (i + 0.5) * width_)].merge(cells_[i], aggregate_, rng_);
+        }
+      }
+      return detail::bucket_columns(buckets, aggregate_);
+    }
+
+    // Sums and counts are split among the buckets a cell overlaps, as if
+    // its points were spread evenly over its part within [min_x, max_x]
+    std::vector<double> sums(buckets_), counts(buckets_);
+    for (std::size_t i = 0; i < cells_.size(); ++i) {
+      const detail::Bucket &c = cells_[i];
+      if (c.count == 0) {
+        continue;
+      }
+      const double a = std::max(min_x_, low_ + i * width_);
+      const double b = std::min(max_x_, low_ + (i + 1) * width_);
+      const std::size_t first = bucket(a), last = bucket(b);
+      for (std::size_t k = first; k <= last; ++k) {
+        double share = 1.0;
+        if (first != last) {
+          const double edge_a = std::max(a, min_x_ + k / scale);
+          const double edge_b = std::min(b, min_x_ + (k + 1) / scale);
+          share = std::max(0.0, edge_b - edge_a) / (b - a);
+        }
+        sums[k] += share * c.sum;
+        counts[k] += share * c.count;
+      }
+    }
+    Columns columns;
+    for (std::size_t k = 0; k < buckets_; ++k) {
+      columns.x.push_back(k);
+      columns.y.push_back(aggregate_ == kSum ? sums[k]
+                          : counts[k] > 0   ? sums[k] / counts[k]
+                                            : 0.0);
+    }
+    return columns;
+  }
+
+  const std::string &error() const { return error_; }
+
+private:
+  std::size_t buckets_;
+  std::vector<detail::Bucket> cells_;
+  Aggregate aggregate_;
+  std::minstd_rand rng_;
+  std::string carry_;
+  std::string error_;
+  std::size_t one_column_rows_ = 0;
+
+  // Exact range of the finite x seen
+  double min_x_ = std::numeric_limits<double>::infinity();
+  double max_x_ = -std::numeric_limits<double>::infinity();
+
+  // Until two distinct x are seen, points share the bucket first_
+  bool ranged_ = false;
+  bool has_first_x_ = false;
+  double first_x_ = 0;
+  detail::Bucket first_;
+
+  // Cell i covers [low_ + i * width_, low_ + (i + 1) * width_)
+  double low_ = 0;
+  double width_ = 0;
+
+  bool add_line(const char *line, const char *line_end) {
+    double values[2];
+    switch (parse_line(line, line_end, values)) {
+    case kBlankLine:
+      return true;
+    case kOneColumn:
+      add(one_column_rows_++, values[0]);
+      return true;
+    case kTwoColumns:
+      add(values[0], values[1]);
+      return true;
+    case kInvalidNumber:
+      error_ = "Invalid number in line: " + line_text(line, line_end);
+      return false;
+    case kTooManyColumns:
+      error_ = "Invalid line (expect 1 or 2 columns): " + line_text(line, line_end);
+      return false;
+    }
+    return true;
+  }
+
+  void add(double x, double y) {
+    if (!std::isfinite(x)) {
+      // Kept at the edge they tend to, without moving the grid
+      detail::Bucket &edge = !ranged_ ? first_ : (x > 0 ? cells_.back() : cells_.front());
+      edge.add(y, aggregate_, rng_);
+      return;
+    }
+    min_x_ = std::min(min_x_, x);
+    max_x_ = std::max(max_x_, x);
+    if (!ranged_) {
+      if (!has_first_x_ || x == first_x_) {
+        has_first_x_ = true;
+        first_x_ = x;
+        first_.add(y, aggregate_, rng_);
+        return;
+      }
+      // Both x in the lower half of the grid, leaving room to grow
+      low_ = std::min(x, first_x_);
+      width_ = std::max(2 * std::abs(x - first_x_) / cells_.size(),
+                        std::numeric_limits<double>::denorm_min());
+      ranged_ = true;
+      cells_[cell(first_x_)].merge(first_, aggregate_, rng_);
+      first_ = detail::Bucket();
+    }
+    while (x < low_) {
+      grow(true);
+    }
+    while (x >= low_ + width_ * cells_.size() && std::isfinite(width_)) {
+      grow(false);
+    }
+    cells_[cell(x)].add(y, aggregate_, rng_);
+  }
+
+  std::size_t cell(double x) const {
+    const double position = (x - low_) / width_;
+    return std::min<std::size_t>(position > 0 ? static_cast<std::size_t>(position) : 0,
+                                 cells_.size() - 1);
+  }
+
+  // Doubles the span of the grid, extending it below or above
+  void grow(bool below) {
+    const std::size_t half = cells_.size() / 2;
+    std::vector<detail::Bucket> merged(cells_.size());
+    for (std::size_t i = 0; i < half; ++i) {
+      detail::Bucket &target = merged[below ? half + i : i];
+      target = std::move(cells_[2 * i]);
+      target.merge(cells_[2 * i + 1], aggregate_, rng_);
+    }
+    cells_ = std::move(merged);
+    if (below) {
+      low_ -= width_ * cells_.size();
+    }
+    width_ *= 2;
+  }
+};
+
+namespace detail {
+
+// Range of the x of two-column lines. Single-column ones only count, as
+// their x is known once all chunks are scanned.
+struct ChunkRange {
+  double min_x = std::numeric_limits<double>::infinity();
+  double max_x = -std::numeric_limits<double>::infinity();
+  std::size_t one_column_rows = 0;
+  std::string error;
+};
+
+inline void scan_chunk(const char *begin, const char *end, ChunkRange &out) {
+  for_each_line(begin, end, [&out](const char *line, const char *line_end) {
+    double values[2];
+    switch (parse_line(line, line_end, values)) {
+    case kBlankLine:
+      return true;
+    case kOneColumn:
+      ++out.one_column_rows;
+      return true;
+    case kTwoColumns:
+      out.min_x = std::min(out.min_x, values[0]);
+      out.max_x = std::max(out.max_x, values[0]);
+      return true;
+    case kInvalidNumber:
+      out.error = "Invalid number in line: " + line_text(line, line_end);
+      return false;
+    case kTooManyColumns:
+      out.error = "Invalid line (expect 1 or 2 columns): " +
+                  line_text(line, line_end);
+      return false;
+    }
+    return true;
+  });
+}
+
+} // namespace detail
+
+// Like parse_columns, but reduces the input to `buckets` points in two
+// passes over it: one finding the range of x, one aggregating into buckets.
+// No per-line data is kept, so memory beyond the input itself does not grow
+// with it. Inputs that cannot be read twice go through aggregate_stream.
+inline Columns aggregate_columns(const char *begin, const char *end,
+                                 std::size_t buckets, Aggregate aggregate,
+                                 unsigned threads = 0) {
+  const std::vector<const char *> bounds = detail::split_chunks(begin, end, threads);
+  const std::size_t chunks = bounds.size() - 1;
+
+  std::vector<detail::ChunkRange> ranges(chunks);
+  detail::run_parallel(chunks, [&](std::size_t k) {
+    detail::scan_chunk(bounds[k], bounds[k + 1], ranges[k]);
+  });
+
+  Columns columns;
+  double min_x = std::numeric_limits<double>::infinity();
+  double max_x = -std::numeric_limits<double>::infinity();
+  std::vector<std::size_t> first_index(chunks + 1, 0);
+  for (std::size_t k = 0; k < chunks; ++k) {
+    if (!ranges[k].error.empty()) {
+      columns.error = ranges[k].error;
+      return columns;
+    }
+    min_x = std::min(min_x, ranges[k].min_x);
+    max_x = std::max(max_x, ranges[k].max_x);
+    first_index[k + 1] = first_index[k] + ranges[k].one_column_rows;
+  }
+  if (first_index[chunks] > 0) {
+    min_x = std::min(min_x, 0.0);
+    max_x = std::max(max_x, first_index[chunks] - 1.0);
+  }
+  if (min_x > max_x) {
+    return columns;
+  }
+
+  // Seeded apart, so that chunks draw independent p99 samples
+  std::vector<BucketAggregator> partial;
+  partial.reserve(chunks);
+  for (std::size_t k = 0; k < chunks; ++k) {
+    partial.emplace_back(buckets, min_x, max_x, aggregate, k + 1);
+  }
+  detail::run_parallel(chunks, [&](std::size_t k) {
+    std::size_t one_column_rows = first_index[k];
+    for_each_line(bounds[k], bounds[k + 1], [&](const char *line, const char *line_end) {
+      double values[2];
+      switch (parse_line(line, line_end, values)) {
+      case kOneColumn:
+        partial[k].add(one_column_rows++, values[0]);
+        break;
+      case kTwoColumns:
+        partial[k].add(values[0], values[1]);
+        break;
+      default:
+        break;
+      }
+      return true;
+    });
+  });
+  for (std::size_t k = 1; k < chunks; ++k) {
+    partial[0].merge(partial[k]);
+  }
+  return partial[0].result();
+}
+
+// Aggregates what is left to read from fd, after the bytes [begin, end)
+// already read from it, in blocks of fixed size. Memory stays proportional
+// to the number of buckets, whatever the size of the input.
+inline Columns aggregate_stream(int fd, const char *begin, const char *end,
+                                std::size_t buckets, Aggregate aggregate) {
+  constexpr std::size_t kBlockBytes = 1 << 16;
+  StreamAggregator aggregator(buckets, aggregate);
+  if (!aggregator.feed(begin, end)) {
+    return aggregator.finish();
+  }
+  std::vector<char> block(kBlockBytes);
+  while (true) {
+    const ssize_t n = read(fd, block.data(), block.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return Columns{{}, {}, std::string("Read error: ") + std::strerror(errno)};
+    }
+    if (n == 0 || !aggregator.feed(block.data(), block.data() + n)) {
+      return aggregator.finish();
+    }
+  }
+}
+
+enum ValueType : std::uint8_t { kFloat32 = 1, kFloat64 = 2, kInt64 = 3 };
+
+inline std::size_t value_size(ValueType type) {
+  return type == kFloat32 ? 4 : 8;
+}
+
+// Names as given to --format
+inline bool parse_value_type(const std::string &name, ValueType &type) {
+  static const std::pair<const char *, ValueType> kNames[] = {
+      {"f32", kFloat32}, {"f64", kFloat64}, {"i64", kInt64}};
+  for (const auto &entry : kNames) {
+    if (name == entry.first) {
+      type = entry.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+namespace detail {
+
+// Little-endian value at any alignment
+template <class T>
+T load_le(const std::uint8_t *bytes) {
+  T value;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  std::uint8_t swapped[sizeof(T)];
+  std::reverse_copy(bytes, bytes + sizeof(T), swapped);
+  std::memcpy(&value, swapped, sizeof(T));
+#else
+  std::memcpy(&value, bytes, sizeof(T));
+#endif
+  return value;
+}
+
+template <class T>
+void store_le(T value, std::uint8_t *bytes) {
+  std::memcpy(bytes, &value, sizeof(T));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  std::reverse(bytes, bytes + sizeof(T));
+#endif
+}
+
+} // namespace detail
+
+// A column of numbers stored in place, every `stride` bytes
+struct ColumnView {
+  std::string name;
+  ValueType type = kFloat64;
+  const std::uint8_t *data = nullptr;
+  std::size_t stride = 8;
+
+  double operator[](std::size_t i) const {
+    const std::uint8_t *bytes = data + i * stride;
+    switch (type) {
+    case kFloat32:
+      return detail::load_le<float>(bytes);
+    case kFloat64:
+      return detail::load_le<double>(bytes);
+    case kInt64:
+      return static_cast<double>(detail::load_le<std::int64_t>(bytes));
+    }
+    return 0.0;
+  }
+};
+
+struct BinaryTable {
+  std::vector<ColumnView> columns;
+  std::size_t rows = 0;
+  std::string error;
+};
+
+// Rows of `columns` interleaved values of the same type, with no header
+inline BinaryTable read_raw(const std::uint8_t *data, std::size_t size,
+                            ValueType type, std::size_t columns) {
+  BinaryTable table;
+  const std::size_t row_size = value_size(type) * columns;
+  if (columns == 0 || size % row_size != 0) {
+    table.error = "Input size is not a multiple of " + std::to_string(row_size) +
+                  " bytes";
+    return table;
+  }
+  table.rows = size / row_size;
+  for (std::size_t c = 0; c < columns; ++c) {
+    table.columns.push_back(ColumnView{std::to_string(c + 1), type,
+                                       data + c * value_size(type), row_size});
+  }
+  return table;
+}
+
+// Columnar format, all integers little-endian:
+//
+//   Header, 64 bytes:
+//     0  char[8]   Magic "ASKICOL1"
+//     8  uint32    Number of columns
+//     12 uint32    Reserved, 0
+//     16 uint64    Number of rows
+//     24           Reserved, 0
+//   One descriptor per column, 64 bytes each:
+//     0  uint8     Type: 1 float32, 2 float64, 3 int64
+//     1            Reserved, 0
+//     8  uint64    Offset of the column block from the start of the file,
+//                  a multiple of 64
+//     16 char[48]  Name, NUL-padded
+//   Column blocks: the values of each column, contiguous
+//
+// Blocks are aligned so that a mapped file can be used as arrays in place.
+constexpr char kColumnarMagic[8] = {'A', 'S', 'K', 'I', 'C', 'O', 'L', '1'};
+constexpr std::size_t kColumnarBlock = 64;
+
+inline bool is_columnar(const std::uint8_t *data, std::size_t size) {
+  return size >= sizeof(kColumnarMagic) &&
+         std::memcmp(data, kColumnarMagic, sizeof(kColumnarMagic)) == 0;
+}
+
+inline BinaryTable read_columnar(const std::uint8_t *data, std::size_t size) {
+  BinaryTable table;
+  if (!is_columnar(data, size) || size < kColumnarBlock) {
+    table.error = "Invalid columnar header";
+    return table;
+  }
+  const std::uint32_t columns = detail::load_le<std::uint32_t>(data + 8);
+  const std::uint64_t rows = detail::load_le<std::uint64_t>(data + 16);
+  if (columns > (size - kColumnarBlock) / kColumnarBlock) {
+    table.error = "Invalid columnar header";
+    return table;
+  }
+  table.rows = rows;
+  for (std::uint32_t c = 0; c < columns; ++c) {
+    const std::uint8_t *descriptor = data + kColumnarBlock * (c + 1);
+    const ValueType type = static_cast<ValueType>(descriptor[0]);
+    const std::uint64_t offset = detail::load_le<std::uint64_t>(descriptor + 8);
+    const char *name = reinterpret_cast<const char *>(descriptor + 16);
+    if (type != kFloat32 && type != kFloat64 && type != kInt64) {
+      table.error = "Invalid type of column " + std::to_string(c + 1);
+      return table;
+    }
+    if (offset % kColumnarBlock != 0 || offset > size ||
+        rows > (size - offset) / value_size(type)) {
+      table.error = "Column " + std::to_string(c + 1) + " exceeds the file";
+      return table;
+    }
+    table.columns.push_back(ColumnView{std::string(name, strnlen(name, 48)), type,
+                                       data + offset, value_size(type)});
+  }
+  return table;
+}
+
+// A column to write, pointing to `rows` values of its type
+struct ColumnSource {
+  std::string name;
+  ValueType type;
+  const void *values;
+};
+
+// Writes columns in the format read by read_columnar
+inline void write_columnar(std::ostream &out, const std::vector<ColumnSource> &columns,
+                           std::uint64_t rows) {
+  std::vector<std::uint8_t> header(kColumnarBlock * (columns.size() + 1), 0);
+  std::memcpy(header.data(), kColumnarMagic, sizeof(kColumnarMagic));
+  detail::store_le<std::uint32_t>(columns.size(), header.data() + 8);
+  detail::store_le<std::uint64_t>(rows, header.data() + 16);
+
+  auto padded = [](std::uint64_t n) {
+    return (n + kColumnarBlock - 1) / kColumnarBlock * kColumnarBlock;
+  };
+  std::uint64_t offset = header.size();
+  for (std::size_t c = 0; c < columns.size(); ++c) {
+    std::uint8_t *descriptor = header.data() + kColumnarBlock * (c + 1);
+    descriptor[0] = columns[c].type;
+    detail::store_le<std::uint64_t>(offset, descriptor + 8);
+    std::memcpy(descriptor + 16, columns[c].name.data(),
+                std::min<std::size_t>(columns[c].name.size(), 47));
+    offset += padded(rows * value_size(columns[c].type));
+  }
+  out.write(reinterpret_cast<const char *>(header.data()), header.size());
+
+  const char zeros[kColumnarBlock] = {};
+  for (const auto &column : columns) {
+    const std::uint64_t bytes = rows * value_size(column.type);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    const auto *values = static_cast<const std::uint8_t *>(column.values);
+    std::vector<std::uint8_t> swapped(values, values + bytes);
+    for (std::size_t i = 0; i < bytes; i += value_size(column.type)) {
+      std::reverse(swapped.begin() + i, swapped.begin() + i + value_size(column.type));
+    }
+    out.write(reinterpret_cast<const char *>(swapped.data()), bytes);
+#else
+    out.write(static_cast<const char *>(column.values), bytes);
+#endif
+    out.write(zeros, padded(bytes) - bytes);
+  }
+}
+
+// Columns x and y of a binary table with one or two columns, as text input
+// with as many columns would give
+inline Columns binary_columns(const BinaryTable &table) {
+  Columns columns;
+  if (table.columns.empty() || table.columns.size() > 2) {
+    columns.error = "Invalid input (expect 1 or 2 columns)";
+    return columns;
+  }
+  const ColumnView &y = table.columns.back();
+  columns.x.resize(table.rows);
+  columns.y.resize(table.rows);
+  for (std::size_t i = 0; i < table.rows; ++i) {
+    columns.x[i] = table.columns.size() == 2 ? table.columns[0][i] : i;
+    columns.y[i] = y[i];
+  }
+  return columns;
+}
+
+// Like binary_columns followed by bucketing, without copying the columns
+inline Columns aggregate_binary(const BinaryTable &table, std::size_t buckets,
+                                Aggregate aggregate) {
+  if (table.columns.empty() || table.columns.size() > 2) {
+    return binary_columns(table);
+  }
+  double min_x = 0, max_x = table.rows - 1.0;
+  if (table.columns.size() == 2) {
+    min_x = std::numeric_limits<double>::infinity();
+    max_x = -std::numeric_limits<double>::infinity();
+    for (std::size_t i = 0; i < table.rows; ++i) {
+      min_x = std::min(min_x, table.columns[0][i]);
+      max_x = std::max(max_x, table.columns[0][i]);
+    }
+  }
+  if (table.rows == 0) {
+    return Columns{};
+  }
+  BucketAggregator aggregator(buckets, min_x, max_x, aggregate);
+  const ColumnView &y = table.columns.back();
+  for (std::size_t i = 0; i < table.rows; ++i) {
+    aggregator.add(table.columns.size() == 2 ? table.columns[0][i] : i, y[i]);
+  }
+  return aggregator.result();
+}
+
+// The given columns of a binary table, copied as parse_table returns them
+inline Table binary_table(const BinaryTable &binary,
+                          const std::vector<std::size_t> &wanted) {
+  Table table;
+  table.fields = binary.columns.size();
+  for (const auto &column : binary.columns) {
+    table.names.push_back(column.name);
+  }
+  for (std::size_t column : wanted) {
+    std::vector<double> values(binary.rows);
+    for (std::size_t i = 0; i < binary.rows; ++i) {
+      values[i] = binary.columns[column][i];
+    }
+    table.columns.push_back(std::move(values));
+  }
+  return table;
+}
+
+// Incremental reader for inputs that keep growing: pipes, like a
+// `tail -f` feeding stdin, and files still being written. Growing files are
+// watched with inotify, or polled where it is unavailable; a file truncated
+// by log rotation is read again from its start.
+class FollowReader {
+public:
+  // "-" follows the standard input
+  explicit FollowReader(const std::string &path) {
+    if (path == "-") {
+      fd_ = STDIN_FILENO;
+    } else {
+      fd_ = open(path.c_str(), O_RDONLY);
+      owns_fd_ = true;
+    }
+    struct stat st;
+    regular_ = fd_ >= 0 && fstat(fd_, &st) == 0 && S_ISREG(st.st_mode);
+    if (regular_) {
+      inotify_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (inotify_ >= 0 &&
+          inotify_add_watch(inotify_, path.c_str(), IN_MODIFY | IN_ATTRIB) < 0) {
+        close(inotify_);
+        inotify_ = -1;
+      }
+    }
+  }
+
+  FollowReader(const FollowReader &) = delete;
+  FollowReader &operator=(const FollowReader &) = delete;
+
+  ~FollowReader() {
+    if (inotify_ >= 0) {
+      close(inotify_);
+    }
+    if (owns_fd_ && fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  bool is_open() const { return fd_ >= 0; }
+
+  // Whether a pipe was closed by the writer. Files never end.
+  bool at_end() const { return ended_; }
+
+  // Calls fn(line_begin, line_end) for each complete line available now,
+  // without blocking. A last line without newline is passed at the end of
+  // a pipe. Returns the number of lines passed.
+  template <class Fn>
+  std::size_t read_available(Fn fn) {
+    if (regular_) {
+      rewind_if_truncated();
+    }
+    std::size_t lines = 0;
+    while (!ended_ && readable_now()) {
+      if (buffer_.size() - used_ < kReadSize) {
+        buffer_.resize(used_ + kReadSize);
+      }
+      const ssize_t n = read(fd_, buffer_.data() + used_, kReadSize);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        // End of the file for now, or of the pipe for good
+        ended_ = !regular_;
+        break;
+      }
+      used_ += n;
+      lines += take_lines(fn);
+    }
+    if (ended_ && used_ > 0) {
+      fn(buffer_.data(), buffer_.data() + used_);
+      used_ = 0;
+      ++lines;
+    }
+    return lines;
+  }
+
+  // Blocks until more input may be available, at most timeout_ms
+  void wait(int timeout_ms) {
+    if (ended_) {
+      return;
+    }
+    if (!regular_) {
+      pollfd pfd = {fd_, POLLIN, 0};
+      poll(&pfd, 1, timeout_ms);
+    } else if (inotify_ >= 0) {
+      pollfd pfd = {inotify_, POLLIN, 0};
+      if (poll(&pfd, 1, timeout_ms) > 0) {
+        char events[4096];
+        while (read(inotify_, events, sizeof(events)) > 0) {
+        }
+      }
+    } else {
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(std::min(timeout_ms, kPollIntervalMs)));
+    }
+  }
+
+private:
+  static constexpr std::size_t kReadSize = 1 << 16;
+  static constexpr int kPollIntervalMs = 100;
+
+  int fd_ = -1;
+  bool owns_fd_ = false;
+  bool regular_ = false;
+  bool ended_ = false;
+  int inotify_ = -1;
+  std::vector<char> buffer_;
+  std::size_t used_ = 0;
+
+  bool readable_now() const {
+    if (regular_) {
+      return true;
+    }
+    pollfd pfd = {fd_, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+  }
+
+  void rewind_if_truncated() {
+    struct stat st;
+    const off_t offset = lseek(fd_, 0, SEEK_CUR);
+    if (fstat(fd_, &st) == 0 && offset > st.st_size) {
+      lseek(fd_, 0, SEEK_SET);
+      used_ = 0;
+    }
+  }
+
+  // Passes the complete lines of the buffer and keeps the partial one
+  template <class Fn>
+  std::size_t take_lines(Fn &fn) {
+    std::size_t lines = 0;
+    const char *begin = buffer_.data();
+    const char *end = begin + used_;
+    while (const void *newline = std::memchr(begin, '\n', end - begin)) {
+      fn(begin, static_cast<const char *>(newline));
+      begin = static_cast<const char *>(newline) + 1;
+      ++lines;
+    }
+    used_ = end - begin;
+    std::memmove(buffer_.data(), begin, used_);
+    return lines;
+  }
+};
+
+} // namespace ingest
+
+#endif // ASKIPLOT_TOOLS_INGEST_HPP_